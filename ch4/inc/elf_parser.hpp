@@ -0,0 +1,472 @@
+#ifndef ELF_PARSER_H
+#define ELF_PARSER_H
+
+#include <elf.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include "loader.hpp"
+
+/* Native ELF backend, used by load_binary() under LOAD_F_NATIVE.
+ *
+ * Everything is read straight out of a mapping of the file into Binary,
+ * Section, Segment and Symbol; there are no intermediate library objects.
+ * Sections and segments only get their offset and size here, the caller
+ * fills in the bytes. The ELF class and byte order are template
+ * parameters, so picking the right structure layout and byte swapping is
+ * all resolved at compile time and the common native-endian case decodes
+ * fields with plain loads.
+ */
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define ELF_HOST_DATA ELFDATA2MSB
+#else
+#define ELF_HOST_DATA ELFDATA2LSB
+#endif
+
+/* Deflate tops out a little over 1032:1, so a compression header that
+ * claims more than that from raw_size bytes of stream is lying; it is
+ * turned away before anything gets allocated for the contents */
+#define ELF_MAX_INFLATE_RATIO  1032
+
+static inline bool
+inflated_size_ok(uint64_t raw_size, uint64_t size)
+{
+  return size / ELF_MAX_INFLATE_RATIO <= raw_size;
+}
+
+struct ElfClass32 {
+  typedef Elf32_Ehdr Ehdr;
+  typedef Elf32_Shdr Shdr;
+  typedef Elf32_Sym  Sym;
+  typedef Elf32_Phdr Phdr;
+  typedef Elf32_Chdr Chdr;
+
+  static const unsigned bits = 32;
+};
+
+struct ElfClass64 {
+  typedef Elf64_Ehdr Ehdr;
+  typedef Elf64_Shdr Shdr;
+  typedef Elf64_Sym  Sym;
+  typedef Elf64_Phdr Phdr;
+  typedef Elf64_Chdr Chdr;
+
+  static const unsigned bits = 64;
+};
+
+template<typename C, int Data>
+class ElfParser {
+public:
+  typedef typename C::Ehdr Ehdr;
+  typedef typename C::Shdr Shdr;
+  typedef typename C::Sym  Sym;
+  typedef typename C::Phdr Phdr;
+  typedef typename C::Chdr Chdr;
+
+  ElfParser(const uint8_t *base, size_t size)
+    : base(base), size(size), shoff(0), shnum(0), shstrndx(0),
+      phoff(0), phnum(0) {}
+
+  int load(Binary *bin);
+
+private:
+  static const bool swap = (Data != ELF_HOST_DATA);
+
+  static uint8_t  rd(uint8_t v)  { return v; }
+  static uint16_t rd(uint16_t v) { return swap ? __builtin_bswap16(v) : v; }
+  static uint32_t rd(uint32_t v) { return swap ? __builtin_bswap32(v) : v; }
+  static uint64_t rd(uint64_t v) { return swap ? __builtin_bswap64(v) : v; }
+
+  bool in_bounds(uint64_t off, uint64_t len) const
+    { return (off <= size) && (len <= size - off); }
+
+  /* Headers in hostile files need not be aligned, so copy them out */
+  template<typename T> bool read(uint64_t off, T *out) const
+    { if(!in_bounds(off, sizeof(T))) return false;
+      memcpy(out, base + off, sizeof(T)); return true; }
+
+  bool read_shdr(unsigned i, Shdr *shdr) const
+    { return read(shoff + (uint64_t)i*sizeof(Shdr), shdr); }
+
+  const char *str(const Shdr &strtab, uint64_t idx) const;
+  bool gnu_hash_chain(unsigned dynsym, uint64_t nsyms,
+                      uint64_t *chainoff, uint64_t *symoffset) const;
+
+  int load_header(Binary *bin);
+  int load_sections(Binary *bin);
+  int load_segments(Binary *bin);
+  int load_symbols(Binary *bin, uint32_t shtype);
+
+  const uint8_t *base;
+  size_t         size;
+  uint64_t       shoff;
+  unsigned       shnum;
+  unsigned       shstrndx;
+  uint64_t       phoff;
+  unsigned       phnum;
+};
+
+/* Returns the NUL-terminated string at idx in strtab, or NULL if it runs
+ * off the end of the table */
+template<typename C, int Data> const char*
+ElfParser<C, Data>::str(const Shdr &strtab, uint64_t idx) const
+{
+  uint64_t off, len;
+
+  off = rd(strtab.sh_offset);
+  len = rd(strtab.sh_size);
+  if(!in_bounds(off, len) || idx >= len) {
+    return NULL;
+  }
+  if(!memchr(base + off + idx, '\0', len - idx)) {
+    return NULL;
+  }
+
+  return (const char*)(base + off + idx);
+}
+
+/* Locates the chain array of the .gnu.hash section covering the dynsym
+ * at index dynsym. Entry j - symoffset of the chain holds the hash of
+ * dynamic symbol j (bit 0 aside), which saves rehashing every name. */
+template<typename C, int Data> bool
+ElfParser<C, Data>::gnu_hash_chain(unsigned dynsym, uint64_t nsyms,
+                                   uint64_t *chainoff, uint64_t *symoffset) const
+{
+  unsigned i;
+  uint32_t hdr[4];
+  uint64_t off, len, chain;
+  Shdr shdr;
+
+  for(i = 0; i < shnum; i++) {
+    read_shdr(i, &shdr);
+    if(rd(shdr.sh_type) == SHT_GNU_HASH && rd(shdr.sh_link) == dynsym) break;
+  }
+  if(i == shnum) {
+    return false;
+  }
+
+  off = rd(shdr.sh_offset);
+  len = rd(shdr.sh_size);
+  if(!in_bounds(off, len) || len < sizeof(hdr)) {
+    return false;
+  }
+
+  /* nbuckets, symoffset, bloom_size, bloom_shift; then the bloom filter
+   * (in ELF class sized words), the buckets and finally the chain */
+  read(off, &hdr);
+  chain = sizeof(hdr) + (uint64_t)rd(hdr[2])*(C::bits/8) + (uint64_t)rd(hdr[0])*4;
+  *symoffset = rd(hdr[1]);
+  if(*symoffset > nsyms || chain > len || (nsyms - *symoffset)*4 > len - chain) {
+    return false;
+  }
+  *chainoff = off + chain;
+
+  return true;
+}
+
+template<typename C, int Data> int
+ElfParser<C, Data>::load_header(Binary *bin)
+{
+  Ehdr ehdr;
+  Shdr shdr0;
+
+  if(!read(0, &ehdr)) {
+    load_error("truncated ELF header\n");
+    return -1;
+  }
+
+  bin->type  = Binary::BIN_TYPE_ELF;
+  bin->entry = rd(ehdr.e_entry);
+
+  switch(rd(ehdr.e_machine)) {
+  case EM_386:
+    bin->type_str = "elf32-i386";
+    bin->arch_str = "X86";
+    bin->arch = Binary::ARCH_X86;
+    bin->bits = 32;
+    break;
+  case EM_X86_64:
+    bin->type_str = (C::bits == 64) ? "elf64-x86-64" : "elf32-x86-64";
+    bin->arch_str = "X86_64";
+    bin->arch = Binary::ARCH_X86;
+    bin->bits = 64;
+    break;
+  default:
+    load_error("unsupported architecture (%u)\n", rd(ehdr.e_machine));
+    return -1;
+  }
+
+  phoff    = rd(ehdr.e_phoff);
+  phnum    = rd(ehdr.e_phnum);
+  shoff    = rd(ehdr.e_shoff);
+  shnum    = rd(ehdr.e_shnum);
+  shstrndx = rd(ehdr.e_shstrndx);
+  if(!shoff) {
+    shnum = 0;
+    return 0;
+  }
+
+  /* Large section counts spill over into the first section header */
+  if(!read_shdr(0, &shdr0)) {
+    load_error("section header table extends past the end of the file\n");
+    return -1;
+  }
+  if(shnum == 0) {
+    shnum = rd(shdr0.sh_size);
+  }
+  if(shstrndx == SHN_XINDEX) {
+    shstrndx = rd(shdr0.sh_link);
+  }
+  if(phnum == PN_XNUM) {
+    phnum = rd(shdr0.sh_info);
+  }
+  if(!in_bounds(shoff, (uint64_t)shnum*sizeof(Shdr))) {
+    load_error("section header table extends past the end of the file\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+template<typename C, int Data> int
+ElfParser<C, Data>::load_sections(Binary *bin)
+{
+  unsigned i;
+  uint64_t flags;
+  const char *name;
+  Shdr shdr, shstrtab;
+  Chdr chdr;
+  Section *sec;
+  Section::SectionType sectype;
+
+  if(!read_shdr(shstrndx, &shstrtab)) {
+    memset(&shstrtab, 0, sizeof(shstrtab));
+  }
+
+  bin->sections.reserve(bin->sections.size() + shnum);
+  for(i = 0; i < shnum; i++) {
+    read_shdr(i, &shdr);
+    flags = rd(shdr.sh_flags);
+    if(rd(shdr.sh_type) == SHT_NOBITS && (flags & SHF_TLS)) {
+      continue; // A per-thread template, not part of the address map
+    }
+
+    if(flags & SHF_EXECINSTR) {
+      sectype = Section::SEC_TYPE_CODE;
+    } else if(flags & SHF_ALLOC) {
+      sectype = Section::SEC_TYPE_DATA;
+    } else if((bin->load_flags & Binary::LOAD_F_NONALLOC)
+              && rd(shdr.sh_type) == SHT_PROGBITS) {
+      sectype = Section::SEC_TYPE_NONE; // .debug_* and the like, no address
+    } else {
+      continue; // We only care about code and data sections
+    }
+
+    name = str(shstrtab, rd(shdr.sh_name));
+
+    bin->sections.push_back(Section());
+    sec = &bin->sections.back();
+
+    sec->binary = bin;
+    sec->name   = bin->strings.intern(name ? name : "<unnamed>");
+    sec->type   = sectype;
+    sec->vma    = rd(shdr.sh_addr);
+    sec->size   = rd(shdr.sh_size);
+    sec->offset = rd(shdr.sh_offset);
+    if(rd(shdr.sh_type) == SHT_NOBITS) {
+      sec->zero_fill = true;  // Nothing in the file
+      sec->offset    = 0;
+      continue;
+    }
+    if(!in_bounds(sec->offset, sec->size)) {
+      load_error("section '%s' extends past the end of the file\n",
+                 sec->name.c_str());
+      return -1;
+    }
+
+    /* Compressed contents: describe the stream after the header and what
+     * it inflates to, Section::get_bytes() does the rest */
+    if(flags & SHF_COMPRESSED) {
+      if(sec->size < sizeof(Chdr)) {
+        load_error("section '%s' is too small for its compression header\n",
+                   sec->name.c_str());
+        return -1;
+      }
+      read(sec->offset, &chdr);
+      sec->compress = rd(chdr.ch_type);
+      sec->raw_size = sec->size - sizeof(Chdr);
+      sec->offset  += sizeof(Chdr);
+      sec->size     = rd(chdr.ch_size);
+      if(!inflated_size_ok(sec->raw_size, sec->size)) {
+        load_error("section '%s' claims an implausible size (%ju) when inflated\n",
+                   sec->name.c_str(), sec->size);
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+template<typename C, int Data> int
+ElfParser<C, Data>::load_segments(Binary *bin)
+{
+  unsigned i;
+  Phdr phdr;
+  Segment *seg;
+
+  if(!in_bounds(phoff, (uint64_t)phnum*sizeof(Phdr))) {
+    load_error("program header table extends past the end of the file\n");
+    return -1;
+  }
+
+  bin->segments.reserve(bin->segments.size() + phnum);
+  for(i = 0; i < phnum; i++) {
+    read(phoff + (uint64_t)i*sizeof(Phdr), &phdr);
+    if(rd(phdr.p_type) != PT_LOAD) {
+      continue;
+    }
+
+    bin->segments.push_back(Segment());
+    seg = &bin->segments.back();
+
+    seg->binary    = bin;
+    seg->perms     = rd(phdr.p_flags) & (PF_R | PF_W | PF_X);
+    seg->vma       = rd(phdr.p_vaddr);
+    seg->size      = rd(phdr.p_memsz);
+    seg->file_size = rd(phdr.p_filesz);
+    seg->offset    = rd(phdr.p_offset);
+    if(seg->file_size > seg->size) {
+      seg->file_size = seg->size; // Only memsz bytes ever get mapped
+    }
+    if(!in_bounds(seg->offset, seg->file_size)) {
+      load_error("segment at 0x%016jx extends past the end of the file\n",
+                 seg->vma);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+template<typename C, int Data> int
+ElfParser<C, Data>::load_symbols(Binary *bin, uint32_t shtype)
+{
+  unsigned i;
+  uint32_t hash;
+  uint64_t j, nsyms, nfuncs, symoff, chainoff, hashoff;
+  const char *name;
+  Shdr shdr, strtab;
+  Sym elfsym;
+  Symbol *sym;
+
+  for(i = 0; i < shnum; i++) {
+    read_shdr(i, &shdr);
+    if(rd(shdr.sh_type) == shtype) break;
+  }
+  if(i == shnum) {
+    return 0;
+  }
+
+  if(!read_shdr(rd(shdr.sh_link), &strtab)) {
+    return -1;
+  }
+
+  symoff = rd(shdr.sh_offset);
+  nsyms  = rd(shdr.sh_size) / sizeof(Sym);
+  if(!in_bounds(symoff, nsyms*sizeof(Sym))) {
+    return -1;
+  }
+
+  chainoff = hashoff = 0;
+  if(shtype == SHT_DYNSYM && !gnu_hash_chain(i, nsyms, &chainoff, &hashoff)) {
+    chainoff = 0;
+  }
+
+  /* Counting the functions first is cheap next to growing the vector
+   * (and copying every Symbol) a dozen times over on big tables */
+  for(nfuncs = 0, j = 1; j < nsyms; j++) {
+    read(symoff + j*sizeof(Sym), &elfsym);
+    if(ELF64_ST_TYPE(elfsym.st_info) == STT_FUNC) nfuncs++;
+  }
+  bin->symbols.reserve(bin->symbols.size() + nfuncs);
+
+  for(j = 1; j < nsyms; j++) {
+    read(symoff + j*sizeof(Sym), &elfsym);
+    if(ELF64_ST_TYPE(elfsym.st_info) != STT_FUNC) {
+      continue;
+    }
+
+    name = str(strtab, rd(elfsym.st_name));
+
+    bin->symbols.push_back(Symbol());
+    sym = &bin->symbols.back();
+    sym->type    = Symbol::SYM_TYPE_FUNC;
+    sym->sources = (shtype == SHT_DYNSYM) ? Symbol::SYM_SRC_DYNSYM
+                                          : Symbol::SYM_SRC_SYMTAB;
+    sym->name    = bin->strings.intern(name ? name : "");
+    sym->addr    = rd(elfsym.st_value);
+    sym->size    = rd(elfsym.st_size);
+
+    if(chainoff && j >= hashoff && read(chainoff + (j - hashoff)*4, &hash)) {
+      bin->sym_by_name.set_hash(bin->symbols.size() - 1, rd(hash));
+    }
+  }
+
+  return 0;
+}
+
+template<typename C, int Data> int
+ElfParser<C, Data>::load(Binary *bin)
+{
+  if(load_header(bin) < 0) {
+    return -1;
+  }
+
+  /* Symbol handling is best-effort only (they may not even be present) */
+  if(!(bin->load_flags & Binary::LOAD_F_NO_SYMTAB)) {
+    load_symbols(bin, SHT_SYMTAB);
+  }
+  if(!(bin->load_flags & Binary::LOAD_F_NO_DYNSYM)) {
+    load_symbols(bin, SHT_DYNSYM);
+  }
+
+  if((bin->load_flags & Binary::LOAD_F_SEGMENTS) && load_segments(bin) < 0) {
+    return -1;
+  }
+
+  if(bin->load_flags & Binary::LOAD_F_NO_SECTIONS) {
+    return 0;
+  }
+  return load_sections(bin);
+}
+
+/* Picks the parser instantiation matching the file's ELF class and byte
+ * order. Returns -1 for anything that is not a well-formed ELF header. */
+static inline int
+load_elf_native(const uint8_t *base, size_t size, Binary *bin)
+{
+  if(size < EI_NIDENT || memcmp(base, ELFMAG, SELFMAG)) {
+    load_error("not an ELF file\n");
+    return -1;
+  }
+
+  switch((base[EI_CLASS] << 8) | base[EI_DATA]) {
+  case (ELFCLASS32 << 8) | ELFDATA2LSB:
+    return ElfParser<ElfClass32, ELFDATA2LSB>(base, size).load(bin);
+  case (ELFCLASS32 << 8) | ELFDATA2MSB:
+    return ElfParser<ElfClass32, ELFDATA2MSB>(base, size).load(bin);
+  case (ELFCLASS64 << 8) | ELFDATA2LSB:
+    return ElfParser<ElfClass64, ELFDATA2LSB>(base, size).load(bin);
+  case (ELFCLASS64 << 8) | ELFDATA2MSB:
+    return ElfParser<ElfClass64, ELFDATA2MSB>(base, size).load(bin);
+  default:
+    load_error("unsupported ELF class/data encoding (%u/%u)\n",
+               base[EI_CLASS], base[EI_DATA]);
+    return -1;
+  }
+}
+
+#endif /* ELF_PARSER_H */
@@ -4,7 +4,27 @@
 
 #include <bfd.h>
 #include "loader.hpp"
+#include "elf_parser.hpp"
+#include "pe_parser.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdarg>
+#include <climits>
+#include <condition_variable>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
 
 extern "C" {
 #include <libelfmaster.h>
@@ -12,62 +32,3079 @@ extern "C" {
 
 static int load_binary_bfd(std::string &fname, Binary *bin, Binary::BinaryType type);
 
+static int load_binary_native(std::string &fname, Binary *bin,
+                              int (*parse)(const uint8_t*, size_t, Binary*));
+
 static int load_binary_lem(std::string &fname, Binary *bin);
 static int load_symbols_lem(elfobj_t &obj, Binary *bin);
 static int load_dynsym_lem(elfobj_t &obj, Binary *bin);
 static int load_sections_lem(elfobj_t &obj, Binary *bin);
+static int load_segments_lem(elfobj_t &obj, Binary *bin);
+
+static int map_binary(std::string &fname, Binary *bin);
+static void unmap_binary(Binary *bin);
+static void free_section_bytes(Binary *bin);
+static int map_section_bytes(Section *sec);
+static int map_segment_bytes(Segment *seg);
+static int load_sections_native(Binary *bin);
+
+/* Identifies a parse cache entry or the file a snapshot was taken of: the
+ * file (by stat data or by content hash, depending on the mode) and
+ * everything about the load request that changes what gets parsed.
+ * Compared bytewise, so always memset first. */
+struct CacheKey {
+  uint32_t mode;        /* ParseCacheKey */
+  uint32_t type;        /* Binary::BinaryType asked for */
+  uint32_t flags;       /* the load flags in CACHE_KEY_FLAGS */
+  uint32_t pad;
+  uint64_t dev;         /* PARSE_CACHE_KEY_STAT only */
+  uint64_t ino;
+  uint64_t mtime_sec;
+  uint64_t mtime_nsec;
+  uint64_t size;
+  uint64_t hash;        /* PARSE_CACHE_KEY_CONTENT only */
+};
+
+static int file_key(std::string &fname, Binary *bin, Binary::BinaryType type,
+                    ParseCacheKey mode, CacheKey *key);
+static void clear_binary(Binary *bin);
+static int load_binary_cached(std::string &fname, Binary *bin, const CacheKey *key);
+static int store_binary_cached(Binary *bin, const CacheKey *key);
+
+/* Dispatch counters, see get_loader_stats() */
+static std::atomic<uint64_t> stat_probed_elf(0);
+static std::atomic<uint64_t> stat_probed_pe(0);
+static std::atomic<uint64_t> stat_probed_other(0);
+static std::atomic<uint64_t> stat_bfd_fallbacks(0);
+static std::atomic<uint64_t> stat_cache_hits(0);
+static std::atomic<uint64_t> stat_cache_misses(0);
+static std::atomic<uint64_t> stat_cache_stores(0);
+static std::atomic<uint64_t> stat_shared_hits(0);
+static std::atomic<uint64_t> stat_shared_misses(0);
+static std::atomic<uint64_t> stat_shared_coalesced(0);
+static std::atomic<uint64_t> stat_shared_evictions(0);
+static std::atomic<uint64_t> stat_shared_bytes(0);
+static std::atomic<uint64_t> stat_dedup_bytes(0);
+static std::atomic<uint64_t> stat_dedup_stored(0);
+
+/* Error messages of the load running on this thread go here as well as
+ * to stderr, see load_error(); NULL outside of loads */
+static thread_local std::string *load_errors = NULL;
+
+/* Points load_errors at one Binary's error for the duration of a load,
+ * starting it out empty */
+struct ErrorScope {
+  explicit ErrorScope(std::string *errors) : prev(load_errors)
+    { errors->clear(); load_errors = errors; }
+  ~ErrorScope() { load_errors = prev; }
+
+  std::string *prev;
+};
+
+void
+load_error(const char *fmt, ...)
+{
+  int n;
+  char msg[1024];
+  va_list ap;
+
+  va_start(ap, fmt);
+  n = vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+  if(n < 0) {
+    return;
+  }
+
+  fputs(msg, stderr);
+  if(load_errors) {
+    load_errors->append(msg);
+  }
+}
+
+/* Parse cache settings, see set_parse_cache(); an empty dir means off */
+static std::string   parse_cache_dir;
+static ParseCacheKey parse_cache_mode = PARSE_CACHE_KEY_STAT;
+
+/* Reads the first bytes of the file (or the mapping, if there is one) and
+ * guesses the format from the magic. Unknown formats come back as
+ * BIN_TYPE_AUTO so that BFD can have a go at them. */
+static int
+probe_binary(std::string &fname, Binary *bin, Binary::BinaryType *type)
+{
+  int fd;
+  ssize_t n;
+  uint8_t magic[SELFMAG];
+
+  if(bin->map) {
+    n = bin->map_size < sizeof(magic) ? bin->map_size : sizeof(magic);
+    memcpy(magic, bin->map, n);
+  } else {
+    fd = open(fname.c_str(), O_RDONLY);
+    if(fd < 0) {
+      load_error("failed to open binary '%s' (%s)\n",
+                 fname.c_str(), strerror(errno));
+      return -1;
+    }
+    n = pread(fd, magic, sizeof(magic), 0);
+    close(fd);
+    if(n < 0) {
+      load_error("failed to read binary '%s' (%s)\n",
+                 fname.c_str(), strerror(errno));
+      return -1;
+    }
+  }
+
+  if(n >= SELFMAG && !memcmp(magic, ELFMAG, SELFMAG)) {
+    *type = Binary::BIN_TYPE_ELF;
+  } else if(n >= 2 && magic[0] == 'M' && magic[1] == 'Z') {
+    *type = Binary::BIN_TYPE_PE;
+  } else {
+    *type = Binary::BIN_TYPE_AUTO;
+  }
+
+  return 0;
+}
+
+static int
+load_binary_backend(std::string &fname, Binary *bin, Binary::BinaryType type)
+{
+  Binary::BinaryType probed;
+
+  if(bin->load_flags & Binary::LOAD_F_BFD) {
+    return load_binary_bfd(fname, bin, type);
+  }
+
+  switch(type) {
+  case Binary::BIN_TYPE_AUTO:
+    if(probe_binary(fname, bin, &probed) < 0) {
+      return -1;
+    }
+
+    if(probed == Binary::BIN_TYPE_ELF) {
+      stat_probed_elf++;
+    } else if(probed == Binary::BIN_TYPE_PE) {
+      stat_probed_pe++;
+    } else {
+      stat_probed_other++;
+      return load_binary_bfd(fname, bin, type);
+    }
+
+    // Try the dedicated backend first, then fall back to BFD
+    if(load_binary_backend(fname, bin, probed) == 0) {
+      return 0;
+    }
+    stat_bfd_fallbacks++;
+    bin->sections.clear();
+    bin->segments.clear();
+    bin->symbols.clear();
+    bin->strings.clear();
+    bin->sym_by_name = SymbolNameIndex();  /* .gnu.hash hints by symbol index */
+    return load_binary_bfd(fname, bin, type);
+
+  case Binary::BIN_TYPE_ELF:
+    /* libelfmaster can only open files by name */
+    if((bin->load_flags & Binary::LOAD_F_NATIVE) || bin->map_external) {
+      return load_binary_native(fname, bin, load_elf_native);
+    }
+    return load_binary_lem(fname, bin);
+
+  case Binary::BIN_TYPE_PE:
+    return load_binary_native(fname, bin, load_pe_native);
+
+  default:
+    return load_binary_bfd(fname, bin, type);
+  }
+}
+
+void
+get_loader_stats(LoaderStats *stats)
+{
+  stats->probed_elf    = stat_probed_elf;
+  stats->probed_pe     = stat_probed_pe;
+  stats->probed_other  = stat_probed_other;
+  stats->bfd_fallbacks = stat_bfd_fallbacks;
+  stats->cache_hits    = stat_cache_hits;
+  stats->cache_misses  = stat_cache_misses;
+  stats->cache_stores  = stat_cache_stores;
+
+  stats->shared_hits      = stat_shared_hits;
+  stats->shared_misses    = stat_shared_misses;
+  stats->shared_coalesced = stat_shared_coalesced;
+  stats->shared_evictions = stat_shared_evictions;
+  stats->shared_bytes     = stat_shared_bytes;
+
+  stats->dedup_bytes  = stat_dedup_bytes;
+  stats->dedup_stored = stat_dedup_stored;
+}
+
+void
+reset_loader_stats()
+{
+  stat_probed_elf    = 0;
+  stat_probed_pe     = 0;
+  stat_probed_other  = 0;
+  stat_bfd_fallbacks = 0;
+  stat_cache_hits    = 0;
+  stat_cache_misses  = 0;
+  stat_cache_stores  = 0;
+
+  stat_shared_hits      = 0;
+  stat_shared_misses    = 0;
+  stat_shared_coalesced = 0;
+  stat_shared_evictions = 0;
+}
+
+/* Fills in the Eytzinger-ordered keys from the symbols in sorted order
+ * with an in-order walk of the implicit tree; returns the next sorted
+ * position to place */
+static size_t
+fill_addr_index(std::vector<std::pair<uint64_t, uint32_t> > &sorted,
+                std::vector<uint64_t> &keys, std::vector<size_t> &rank,
+                size_t i, size_t k)
+{
+  if(k < keys.size()) {
+    i = fill_addr_index(sorted, keys, rank, i, 2*k);
+    keys[k] = sorted[i].first;
+    rank[k] = i;
+    i = fill_addr_index(sorted, keys, rank, i + 1, 2*k + 1);
+  }
+
+  return i;
+}
+
+void
+SymbolAddrIndex::build(std::vector<Symbol> &symbols, const SectionIndex &sections)
+{
+  size_t i, k;
+  uint64_t start, end;
+  Symbol *sym;
+  std::vector<size_t> rank;
+  std::vector<std::pair<uint64_t, uint32_t> > sorted;
+
+  /* Undefined symbols (imports) have no address of their own. Ties are
+   * broken by symbol index, so the result does not depend on the sort. */
+  for(i = 0; i < symbols.size(); i++) {
+    if(symbols[i].addr) sorted.push_back(std::make_pair(symbols[i].addr, (uint32_t)i));
+  }
+  if(!std::is_sorted(sorted.begin(), sorted.end())) {
+    std::sort(sorted.begin(), sorted.end());
+  }
+
+  keys.clear();
+  pred.clear();
+  if(sorted.empty()) {
+    return;
+  }
+
+  keys.resize(sorted.size() + 1);
+  rank.resize(sorted.size() + 1);
+  fill_addr_index(sorted, keys, rank, 0, 1);
+
+  /* Slot 0 stands for "past the last key"; rank[0] is unused otherwise */
+  rank[0] = sorted.size();
+  pred.resize(sorted.size() + 1);
+  for(k = 0; k < pred.size(); k++) {
+    if(rank[k] == 0) {
+      pred[k].end = 0;
+      pred[k].sym = -1;
+      continue;
+    }
+    sym = &symbols[sorted[rank[k] - 1].second];
+    pred[k].sym = sorted[rank[k] - 1].second;
+    if(sym->size && sym->addr + sym->size > sym->addr) {
+      pred[k].end = sym->addr + sym->size;
+    } else if(rank[k] < sorted.size()) {
+      /* Lookups only land here for the last symbol at its address, so
+       * the next key is strictly above it */
+      pred[k].end = sorted[rank[k]].first;
+    } else if(sections.lookup(sym->addr, &start, &end) >= 0) {
+      pred[k].end = end;
+    } else {
+      pred[k].end = sym->addr + 1;  /* in no section: just its address */
+    }
+  }
+}
+
+#define ARENA_BLOCK_SIZE  (64*1024)
+
+Arena::Arena(Arena &&o)
+  : blocks(std::move(o.blocks)), cur(o.cur), cur_used(o.cur_used),
+    cur_size(o.cur_size), nbytes(o.nbytes), allocator(o.allocator)
+{
+  o.blocks.clear();
+  o.cur = NULL;
+  o.cur_used = o.cur_size = o.nbytes = 0;
+}
+
+Arena&
+Arena::operator=(Arena &&o)
+{
+  if(this != &o) {
+    reset();
+    std::swap(blocks, o.blocks);
+    std::swap(cur, o.cur);
+    std::swap(cur_used, o.cur_used);
+    std::swap(cur_size, o.cur_size);
+    std::swap(nbytes, o.nbytes);
+    std::swap(allocator, o.allocator);
+  }
+
+  return *this;
+}
+
+void
+Arena::set_allocator(const ArenaAllocator *a)
+{
+  reset();
+  if(a) {
+    allocator = *a;
+  } else {
+    allocator = ArenaAllocator();
+  }
+}
+
+void
+Arena::reset()
+{
+  for(auto &b : blocks) {
+    if(allocator.alloc) {
+      allocator.free(b.p, b.size, allocator.ctx);
+    } else {
+      free(b.p);
+    }
+  }
+  blocks.clear();
+  cur = NULL;
+  cur_used = cur_size = nbytes = 0;
+}
+
+char*
+Arena::new_block(size_t size)
+{
+  Block b;
+
+  b.size = size;
+  b.p = (char*)(allocator.alloc ? allocator.alloc(size, allocator.ctx) : malloc(size));
+  if(!b.p) {
+    return NULL;
+  }
+  blocks.push_back(b);
+  nbytes += size;
+
+  return b.p;
+}
+
+/* align must be a power of two no larger than malloc's alignment */
+void*
+Arena::alloc(size_t n, size_t align)
+{
+  char *p;
+  size_t off;
+
+  /* Big allocations (section contents, mostly) get a block to themselves
+   * so as not to waste the rest of the current one */
+  if(n > ARENA_BLOCK_SIZE/4) {
+    return new_block(n);
+  }
+
+  off = (cur_used + align - 1) & ~(align - 1);
+  if(!cur || off > cur_size || cur_size - off < n) {
+    cur = new_block(ARENA_BLOCK_SIZE);
+    if(!cur) {
+      cur_used = cur_size = 0;
+      return NULL;
+    }
+    cur_size = ARENA_BLOCK_SIZE;
+    off = 0;
+  }
+
+  p = cur + off;
+  cur_used = off + n;
+
+  return p;
+}
+
+StringArena::StringArena(StringArena &&o)
+  : mem(std::move(o.mem)), table(std::move(o.table)), count(o.count)
+{
+  o.table.clear();
+  o.count = 0;
+}
+
+StringArena&
+StringArena::operator=(StringArena &&o)
+{
+  if(this != &o) {
+    mem = std::move(o.mem);
+    table.clear();
+    std::swap(table, o.table);
+    count = o.count;
+    o.count = 0;
+  }
+
+  return *this;
+}
+
+void
+StringArena::clear()
+{
+  mem.reset();
+  table.clear();
+  count = 0;
+}
+
+void
+StringArena::reserve(size_t n)
+{
+  size_t j, mask, size;
+  std::vector<const char*> old;
+
+  /* Keep the table at most half full */
+  for(size = table.empty() ? 1024 : table.size(); size < 2*n; size *= 2);
+  if(size == table.size()) {
+    return;
+  }
+
+  old.swap(table);
+  table.assign(size, NULL);
+  mask = table.size() - 1;
+  for(auto s : old) {
+    if(!s) continue;
+    for(j = header(s)->hash & mask; table[j]; j = (j + 1) & mask);
+    table[j] = s;
+  }
+}
+
+StrRef
+StringArena::intern(const char *s, size_t len)
+{
+  size_t i, j, mask;
+  uint32_t h;
+  const Header *e;
+  Header *hdr;
+  char *p;
+
+  if(2*(count + 1) > table.size()) {
+    reserve(count + 1);
+  }
+
+  h = 2166136261u;
+  for(i = 0; i < len; i++) {
+    h = (h ^ (uint8_t)s[i])*16777619u;
+  }
+
+  mask = table.size() - 1;
+  for(j = h & mask; table[j]; j = (j + 1) & mask) {
+    e = header(table[j]);
+    if(e->hash == h && e->len == len && !memcmp(table[j], s, len)) {
+      return StrRef(table[j], len);
+    }
+  }
+
+  hdr = (len <= UINT32_MAX) ? (Header*)mem.alloc(sizeof(Header) + len + 1, alignof(Header))
+                            : NULL;
+  if(!hdr) {
+    load_error("failed to allocate memory for string of size %zu\n", len);
+    return StrRef();
+  }
+  hdr->hash = h;
+  hdr->len  = len;
+  p = (char*)(hdr + 1);
+  memcpy(p, s, len);
+  p[len] = '\0';
+
+  table[j] = p;
+  count++;
+
+  return StrRef(p, len);
+}
+
+/* The hash function of .gnu.hash sections. Its low bit is not stored in
+ * the section (it marks the end of a chain there), so the name index
+ * always ignores it, and takes home slots from the bits above it. */
+static uint32_t
+gnu_hash(StrRef s)
+{
+  size_t i;
+  uint32_t h = 5381;
+
+  for(i = 0; i < s.size(); i++) {
+    h = (h << 5) + h + (uint8_t)s[i];
+  }
+
+  return h & ~1u;
+}
+
+void
+SymbolNameIndex::build(std::vector<Symbol> &symbols)
+{
+  size_t i, j, mask, nslots;
+  uint32_t h;
+
+  nslots = 16;
+  while(nslots < 2*symbols.size()) {
+    nslots <<= 1;
+  }
+  mask = nslots - 1;
+
+  slots.assign(nslots, Slot());
+  for(auto &slot : slots) {
+    slot.sym = -1;
+  }
+
+  for(i = 0; i < symbols.size(); i++) {
+    h = (i < hints.size() && hints[i]) ? (hints[i] & ~1u)
+                                       : gnu_hash(symbols[i].name);
+
+    /* Only the first symbol of any given name gets a slot */
+    for(j = (h >> 1) & mask; slots[j].sym >= 0; j = (j + 1) & mask) {
+      if(slots[j].hash == h && symbols[slots[j].sym].name == symbols[i].name) {
+        break;
+      }
+    }
+    if(slots[j].sym < 0) {
+      slots[j].hash = h;
+      slots[j].sym  = i;
+    }
+  }
+
+  hints.clear();
+  hints.shrink_to_fit();
+}
+
+void
+SymbolNameIndex::remap_hints(const std::vector<uint32_t> &to, size_t nsyms)
+{
+  size_t j;
+  std::vector<uint32_t> old;
+
+  if(hints.empty()) {
+    return;
+  }
+
+  old.swap(hints);
+  hints.assign(nsyms, 0);
+  for(j = 0; j < old.size() && j < to.size(); j++) {
+    if(old[j]) hints[to[j]] = old[j];
+  }
+}
+
+long
+SymbolNameIndex::lookup(std::vector<Symbol> &symbols, StrRef name) const
+{
+  size_t j, mask;
+  uint32_t h;
+
+  if(slots.empty()) {
+    return -1;
+  }
+
+  h = gnu_hash(name);
+  mask = slots.size() - 1;
+  for(j = (h >> 1) & mask; slots[j].sym >= 0; j = (j + 1) & mask) {
+    if(slots[j].hash == h && symbols[slots[j].sym].name == name) {
+      return slots[j].sym;
+    }
+  }
+
+  return -1;
+}
+
+void
+SymbolColumns::build(const std::vector<Symbol> &symbols)
+{
+  size_t i, n;
+
+  n = symbols.size();
+  addrs.resize(n);
+  sizes.resize(n);
+  types.resize(n);
+  sources.resize(n);
+  names.resize(n);
+
+  for(i = 0; i < n; i++) {
+    addrs[i] = symbols[i].addr;
+    sizes[i] = symbols[i].size;
+    types[i] = (uint8_t)symbols[i].type;
+    sources[i] = symbols[i].sources;
+    names[i] = symbols[i].name;
+  }
+}
+
+void
+SymbolColumns::clear()
+{
+  addrs.clear();
+  sizes.clear();
+  types.clear();
+  sources.clear();
+  names.clear();
+}
+
+/* Orders symbol indexes by address, then name, then original position */
+struct SymbolOrder {
+  const std::vector<Symbol> &symbols;
+
+  SymbolOrder(const std::vector<Symbol> &symbols) : symbols(symbols) {}
+
+  bool operator()(uint32_t a, uint32_t b) const
+    { const Symbol &x = symbols[a], &y = symbols[b]; int c;
+      if(x.addr != y.addr) return x.addr < y.addr;
+      if(x.name.data() != y.name.data()
+         && (c = strcmp(x.name.c_str(), y.name.c_str())) != 0) return c < 0;
+      return a < b; }
+};
+
+static bool
+same_symbol(const Symbol &a, const Symbol &b)
+{
+  /* Names are interned, so equal names are the same pointer */
+  return (a.addr == b.addr) && (a.name.data() == b.name.data());
+}
+
+/* Sorts Binary::symbols by address and collapses the entries sharing a
+ * name and address, as every exported function of an unstripped shared
+ * object does once the symtab and the dynsym have both been appended.
+ * The survivor records all the tables it came from, and a size if any
+ * of the copies had one. */
+static void
+merge_symbols(Binary *bin)
+{
+  size_t i, n;
+  std::vector<uint32_t> order, to;
+  std::vector<Symbol> merged;
+  std::vector<Symbol> &symbols = bin->symbols;
+  SymbolOrder less(symbols);
+
+  /* Nothing to do for a table that is already merged, e.g. one that came
+   * out of the parse cache */
+  for(i = 1; i < symbols.size(); i++) {
+    if(!less(i - 1, i) || same_symbol(symbols[i - 1], symbols[i])) break;
+  }
+  if(i >= symbols.size()) {
+    return;
+  }
+
+  order.resize(symbols.size());
+  for(i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), less);
+
+  for(n = 0, i = 0; i < order.size(); i++) {
+    if(i == 0 || !same_symbol(symbols[order[i - 1]], symbols[order[i]])) n++;
+  }
+  merged.reserve(n);
+  to.resize(symbols.size());
+
+  for(i = 0; i < order.size(); i++) {
+    Symbol &sym = symbols[order[i]];
+    if(!merged.empty() && same_symbol(merged.back(), sym)) {
+      merged.back().sources |= sym.sources;
+      if(!merged.back().size) merged.back().size = sym.size;
+    } else {
+      merged.push_back(sym);
+    }
+    to[order[i]] = merged.size() - 1;
+  }
+
+  symbols.swap(merged);
+  bin->sym_by_name.remap_hints(to, symbols.size());
+}
+
+/* Section names that SectionIndex keeps a handle on */
+static const struct {
+  const char               *name;
+  SectionIndex::SectionId   id;
+} well_known_sections[] = {
+  { ".text",     SectionIndex::SEC_ID_TEXT     },
+  { ".data",     SectionIndex::SEC_ID_DATA     },
+  { ".rodata",   SectionIndex::SEC_ID_RODATA   },
+  { ".rdata",    SectionIndex::SEC_ID_RODATA   },
+  { ".plt",      SectionIndex::SEC_ID_PLT      },
+  { ".got",      SectionIndex::SEC_ID_GOT      },
+  { ".init",     SectionIndex::SEC_ID_INIT     },
+  { ".fini",     SectionIndex::SEC_ID_FINI     },
+  { ".eh_frame", SectionIndex::SEC_ID_EH_FRAME },
+  { ".bss",      SectionIndex::SEC_ID_BSS      }
+};
+
+Section*
+Binary::get_section(SectionIndex::SectionId id)
+{
+  size_t j;
+  long i;
+
+  if(!sec_index.built()) {
+    for(auto &sec : sections) {
+      for(j = 0; j < sizeof(well_known_sections)/sizeof(well_known_sections[0]); j++) {
+        if(well_known_sections[j].id == id && sec.name == well_known_sections[j].name) {
+          return &sec;
+        }
+      }
+    }
+    return NULL;
+  }
+
+  i = sec_index.find(id);
+
+  return (i < 0 || (size_t)i >= sections.size()) ? NULL : &sections[i];
+}
+
+/* Caps the page table; sparser layouts get bigger pages instead */
+#define SECTION_INDEX_MAX_PAGES  (1 << 16)
+
+void
+SectionIndex::build(std::vector<Section> &sections)
+{
+  size_t i, j;
+  std::vector<std::pair<uint64_t, uint64_t> > extents;
+
+  for(i = 0; i < SEC_ID_MAX; i++) {
+    ids[i] = -1;
+  }
+  for(i = 0; i < sections.size(); i++) {
+    for(j = 0; j < sizeof(well_known_sections)/sizeof(well_known_sections[0]); j++) {
+      if(ids[well_known_sections[j].id] < 0 && sections[i].name == well_known_sections[j].name) {
+        ids[well_known_sections[j].id] = i;
+      }
+    }
+  }
+
+  /* Non-allocated sections are not in the address map; size 0 skips them */
+  extents.reserve(sections.size());
+  for(auto &sec : sections) {
+    extents.push_back(std::make_pair(sec.vma, sec.type == Section::SEC_TYPE_NONE
+                                              ? 0 : sec.size));
+  }
+  build_ranges(extents);
+}
+
+void
+SectionIndex::build(std::vector<Segment> &segments)
+{
+  size_t i;
+  std::vector<std::pair<uint64_t, uint64_t> > extents;
+
+  for(i = 0; i < SEC_ID_MAX; i++) {
+    ids[i] = -1;
+  }
+
+  extents.reserve(segments.size());
+  for(auto &seg : segments) {
+    extents.push_back(std::make_pair(seg.vma, seg.size));
+  }
+  build_ranges(extents);
+}
+
+/* extents[i] holds the start address and size of section (or segment) i */
+void
+SectionIndex::build_ranges(const std::vector<std::pair<uint64_t, uint64_t> > &extents)
+{
+  size_t i, j, p, npages;
+  uint64_t at, end;
+  long sec;
+  Range r;
+  std::set<long> active;
+  std::vector<std::pair<uint64_t, long> > bounds;  /* ~sec marks an end */
+
+  for(i = 0; i < extents.size(); i++) {
+    if(!extents[i].second) continue;
+    end = extents[i].first + extents[i].second;
+    if(end < extents[i].first) end = UINT64_MAX;
+    bounds.push_back(std::make_pair(extents[i].first, (long)i));
+    bounds.push_back(std::make_pair(end, ~(long)i));
+  }
+  std::sort(bounds.begin(), bounds.end());
+
+  /* Sweep over the section boundaries; between any two of them the
+   * address space belongs to the lowest-numbered active section */
+  ranges.clear();
+  for(i = 0; i < bounds.size(); ) {
+    at = bounds[i].first;
+    for(; i < bounds.size() && bounds[i].first == at; i++) {
+      if(bounds[i].second >= 0) {
+        active.insert(bounds[i].second);
+      } else {
+        active.erase(~bounds[i].second);
+      }
+    }
+    if(active.empty()) {
+      continue;
+    }
+
+    end = bounds[i].first;  /* the last bound always closes everything */
+    sec = *active.begin();
+    if(!ranges.empty() && ranges.back().sec == sec && ranges.back().end == at) {
+      ranges.back().end = end;
+    } else {
+      r.start = at;
+      r.end   = end;
+      r.sec   = sec;
+      ranges.push_back(r);
+    }
+  }
+
+  base  = ranges.empty() ? 0 : ranges.front().start;
+  span  = ranges.empty() ? 0 : ranges.back().end - base;
+  shift = 12;
+  while(span && ((span - 1) >> shift) >= SECTION_INDEX_MAX_PAGES) {
+    shift++;
+  }
+
+  r.start = r.end = UINT64_MAX;
+  r.sec   = -1;
+  ranges.push_back(r);
+
+  npages = span ? ((span - 1) >> shift) + 1 : 0;
+  pages.resize(npages);
+  for(j = 0, p = 0; p < npages; p++) {
+    at = base + ((uint64_t)p << shift);
+    while(ranges[j].end <= at) j++;
+    pages[p] = j;
+  }
+}
+
+void
+SectionIndex::clip_to_gap(uint64_t addr, uint64_t *start, uint64_t *end) const
+{
+  size_t i;
+
+  if(ranges.size() < 2) {
+    return;  /* only the sentinel: no sections at all */
+  }
+
+  if(addr < base) {
+    *end = std::min(*end, base);
+    return;
+  }
+  if(addr - base >= span) {
+    *start = std::max(*start, base + span);
+    return;
+  }
+
+  /* The first range ending past addr starts past it too, and the one
+   * before it is the last to end at or below addr */
+  for(i = pages[(addr - base) >> shift]; ranges[i].end <= addr; i++);
+  *end = std::min(*end, ranges[i].start);
+  if(i > 0) {
+    *start = std::max(*start, ranges[i - 1].end);
+  }
+}
+
+/* Post-processing shared by all backends once a load has succeeded */
+static void
+finish_binary(Binary *bin)
+{
+  merge_symbols(bin);
+  bin->sec_index.build(bin->sections);
+  bin->seg_index.build(bin->segments);
+  bin->vread_start = bin->vread_end = 0;
+  bin->vread_bytes = NULL;
+  bin->sym_by_addr.build(bin->symbols, bin->sec_index);
+  bin->sym_by_name.build(bin->symbols);
+  if(bin->load_flags & Binary::LOAD_F_SYMBOL_COLUMNS) {
+    bin->symcols.build(bin->symbols);
+  }
+}
+
+int
+load_binary(std::string &fname, Binary *bin, Binary::BinaryType type, int flags)
+{
+  int ret;
+  bool cached;
+  CacheKey key;
+  ErrorScope errors(&bin->error);
+
+  bin->load_flags = flags;
+
+  if(flags & Binary::LOAD_F_MMAP) {
+    if(map_binary(fname, bin) < 0) {
+      return -1;
+    }
+  }
+
+  cached = !parse_cache_dir.empty()
+           && file_key(fname, bin, type, parse_cache_mode, &key) == 0;
+  if(cached) {
+    /* The entry has the indexes too, so there is nothing to finish */
+    if(load_binary_cached(fname, bin, &key) == 0) {
+      stat_cache_hits++;
+      if(flags & Binary::LOAD_F_SYMBOL_COLUMNS) {
+        bin->symcols.build(bin->symbols);
+      }
+      bin->error.clear();
+      return 0;
+    }
+    stat_cache_misses++;
+  }
+
+  ret = load_binary_backend(fname, bin, type);
+  if(ret < 0) {
+    unmap_binary(bin);
+    return ret;
+  }
+
+  finish_binary(bin);
+
+  /* Best-effort: a failed store only costs the next load a parse */
+  if(cached && store_binary_cached(bin, &key) == 0) {
+    stat_cache_stores++;
+  }
+
+  /* Only failures are kept, not what a backend we fell back from said */
+  bin->error.clear();
+
+  return 0;
+}
+
+int
+load_binary_from_memory(const uint8_t *buf, size_t size, Binary *bin,
+                        Binary::BinaryType type, int flags)
+{
+  int ret;
+  std::string name("<memory>");
+  ErrorScope errors(&bin->error);
+
+  /* Without LOAD_F_ALIAS the buffer may go away as soon as we return, so
+   * all section contents have to be copied out during the load */
+  if(flags & Binary::LOAD_F_ALIAS) {
+    flags |= Binary::LOAD_F_MMAP;
+  } else {
+    flags &= ~(Binary::LOAD_F_MMAP | Binary::LOAD_F_LAZY);
+  }
+
+  bin->load_flags   = flags;
+  bin->map          = (uint8_t*)buf;
+  bin->map_size     = size;
+  bin->map_external = true;
+
+  ret = load_binary_backend(name, bin, type);
+  if(ret < 0 || !(flags & Binary::LOAD_F_ALIAS)) {
+    unmap_binary(bin);
+  }
+  if(ret < 0) {
+    return ret;
+  }
+
+  finish_binary(bin);
+  bin->error.clear();
+
+  return 0;
+}
+
+/* Releases everything unload_binary() does except the file mapping */
+static void
+clear_binary(Binary *bin)
+{
+  free_section_bytes(bin);
+
+  std::vector<Section>().swap(bin->sections);
+  std::vector<Segment>().swap(bin->segments);
+  std::vector<Symbol>().swap(bin->symbols);
+  bin->symcols     = SymbolColumns();
+  bin->sym_by_addr = SymbolAddrIndex();
+  bin->sym_by_name = SymbolNameIndex();
+  bin->sec_index   = SectionIndex();
+  bin->seg_index   = SectionIndex();
+  bin->vread_start = bin->vread_end = 0;
+  bin->vread_bytes = NULL;
+  std::vector<uint8_t>().swap(bin->vread_buf);
+  bin->strings.clear();
+
+  if(bin->snap) {
+    munmap(bin->snap, bin->snap_size);
+    bin->snap      = NULL;
+    bin->snap_size = 0;
+  }
+}
+
+void
+unload_binary(Binary *bin)
+{
+  clear_binary(bin);
+  unmap_binary(bin);
+}
+
+Binary::~Binary()
+{
+  unload_binary(this);
+}
+
+Binary::Binary(Binary &&o)
+  : Binary()
+{
+  *this = std::move(o);
+}
+
+Binary&
+Binary::operator=(Binary &&o)
+{
+  if(this == &o) {
+    return *this;
+  }
+
+  unload_binary(this);
+
+  filename     = std::move(o.filename);
+  type         = o.type;
+  type_str     = std::move(o.type_str);
+  arch         = o.arch;
+  arch_str     = std::move(o.arch_str);
+  bits         = o.bits;
+  entry        = o.entry;
+  sections     = std::move(o.sections);
+  sec_index    = std::move(o.sec_index);
+  segments     = std::move(o.segments);
+  seg_index    = std::move(o.seg_index);
+  symbols      = std::move(o.symbols);
+  symcols      = std::move(o.symcols);
+  error        = std::move(o.error);
+  arena        = std::move(o.arena);
+  strings      = std::move(o.strings);
+  sym_by_addr  = std::move(o.sym_by_addr);
+  sym_by_name  = std::move(o.sym_by_name);
+  load_flags   = o.load_flags;
+  map          = o.map;
+  map_size     = o.map_size;
+  map_external = o.map_external;
+  snap         = o.snap;
+  snap_size    = o.snap_size;
+  zero_maps    = std::move(o.zero_maps);
+  dedup_refs   = std::move(o.dedup_refs);
+  vread_start  = o.vread_start;
+  vread_end    = o.vread_end;
+  vread_bytes  = o.vread_bytes;
+  vread_buf    = std::move(o.vread_buf);
+
+  /* The arenas' blocks and the mapping stay where they are, so only the
+   * back pointers need fixing up */
+  for(auto &sec : sections) {
+    sec.binary = this;
+  }
+  for(auto &seg : segments) {
+    seg.binary = this;
+  }
+
+  /* Leave o empty but usable, as clear_binary() would: the indexes keep
+   * their base and shift when their tables move, so reset them whole */
+  o.sections.clear();
+  o.segments.clear();
+  o.symbols.clear();
+  o.symcols      = SymbolColumns();
+  o.sym_by_addr  = SymbolAddrIndex();
+  o.sym_by_name  = SymbolNameIndex();
+  o.sec_index    = SectionIndex();
+  o.seg_index    = SectionIndex();
+  o.map          = NULL;
+  o.map_size     = 0;
+  o.map_external = false;
+  o.snap         = NULL;
+  o.snap_size    = 0;
+  o.zero_maps.clear();
+  o.dedup_refs.clear();
+  o.vread_start  = o.vread_end = 0;
+  o.vread_bytes  = NULL;
+  o.vread_buf.clear();
+
+  return *this;
+}
+
+/* Per-worker job queue for load_binaries(). Workers take jobs from the
+ * front of their own queue and steal from the back of the others' once
+ * theirs runs dry, which keeps everyone busy when file sizes are skewed. */
+class LoadQueue {
+public:
+  std::mutex          lock;
+  std::deque<size_t>  jobs;
+};
+
+static bool
+next_load_job(std::vector<LoadQueue> &queues, unsigned self, size_t *job)
+{
+  unsigned i, victim;
+
+  for(i = 0; i < queues.size(); i++) {
+    victim = (self + i) % queues.size();
+
+    std::lock_guard<std::mutex> guard(queues[victim].lock);
+    if(queues[victim].jobs.empty()) {
+      continue;
+    }
+    if(victim == self) {
+      *job = queues[victim].jobs.front();
+      queues[victim].jobs.pop_front();
+    } else {
+      *job = queues[victim].jobs.back();
+      queues[victim].jobs.pop_back();
+    }
+    return true;
+  }
+
+  return false;
+}
+
+static void
+load_worker(std::vector<std::string> &fnames, Binary::BinaryType type, int flags,
+            std::vector<LoadQueue> &queues, unsigned self,
+            std::mutex &callback_lock, LoadCallback &callback, int *failed)
+{
+  size_t job;
+  Binary *bin;
+  std::string error;
+
+  while(next_load_job(queues, self, &job)) {
+    error.clear();
+    bin = new Binary();
+    if(load_binary(fnames[job], bin, type, flags) < 0) {
+      error.swap(bin->error);
+      unload_binary(bin);
+      delete bin;
+      bin = NULL;
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(callback_lock);
+      if(!bin) (*failed)++;
+      callback(fnames[job], bin, error);
+    }
+
+    if(bin) {
+      unload_binary(bin);
+      delete bin;
+    }
+  }
+}
+
+int
+load_binaries(std::vector<std::string> &fnames, Binary::BinaryType type,
+              int flags, unsigned nthreads, LoadCallback callback)
+{
+  size_t i;
+  int failed;
+  std::mutex callback_lock;
+  std::vector<std::thread> workers;
+
+  if(!nthreads) {
+    nthreads = std::thread::hardware_concurrency();
+  }
+  if(!nthreads) {
+    nthreads = 1;
+  }
+  if(nthreads > fnames.size()) {
+    nthreads = fnames.size();
+  }
+  if(!nthreads) {
+    return 0;
+  }
+
+  std::vector<LoadQueue> queues(nthreads);
+  for(i = 0; i < fnames.size(); i++) {
+    queues[i % nthreads].jobs.push_back(i);
+  }
+
+  failed = 0;
+  for(i = 0; i < nthreads; i++) {
+    workers.push_back(std::thread(load_worker, std::ref(fnames), type, flags,
+                                  std::ref(queues), (unsigned)i,
+                                  std::ref(callback_lock), std::ref(callback),
+                                  &failed));
+  }
+  for(auto &w : workers) {
+    w.join();
+  }
+
+  return failed;
+}
+
+/* Snapshots: a loaded Binary as one flat image. A SnapHeader comes first
+ * and locates everything else by file offset and count, so the image
+ * holds no pointers and can be mapped at any address. Names and stored
+ * section contents are used in place; the records and the lookup indexes
+ * are copied into the Binary's tables with one pass over each, and
+ * nothing is parsed, hashed or sorted again. Parse cache entries are
+ * snapshots without section contents. */
+#define SNAP_MAGIC       "BINSNAP"
+#define SNAP_VERSION     4
+#define SNAP_BYTE_ORDER  0x01020304u
+#define SNAP_ALIGN       16
+
+/* Load flags that change what the parse produces; the others only change
+ * how section contents are brought in, which a cache hit does afresh */
+#define CACHE_KEY_FLAGS  (Binary::LOAD_F_NATIVE | Binary::LOAD_F_NO_SYMTAB \
+                          | Binary::LOAD_F_NO_DYNSYM | Binary::LOAD_F_NO_SECTIONS \
+                          | Binary::LOAD_F_SEGMENTS | Binary::LOAD_F_NONALLOC \
+                          | Binary::LOAD_F_BFD)
+
+struct SnapTable {
+  uint64_t off;          /* from the start of the snapshot */
+  uint64_t count;        /* entries */
+};
+
+struct SnapString {
+  uint32_t off;          /* into the string pool, NUL-terminated there */
+  uint32_t len;
+};
+
+/* A SectionIndex, with its arrays stored as they are in memory */
+struct SnapIndex {
+  SnapTable ranges;
+  SnapTable pages;
+  uint64_t  base;
+  uint64_t  span;
+  uint64_t  shift;
+  int64_t   ids[SectionIndex::SEC_ID_MAX];
+};
+
+struct SnapHeader {
+  char       magic[8];
+  uint32_t   version;
+  uint32_t   byte_order;  /* SNAP_BYTE_ORDER as the writer saw it */
+  uint32_t   word_size;   /* sizeof(long) of the writer */
+  uint32_t   has_bytes;   /* section and segment contents are stored */
+  uint64_t   size;        /* of the whole snapshot */
+  CacheKey   key;         /* the file the snapshot was taken of */
+  uint32_t   type;        /* Binary::BinaryType */
+  uint32_t   arch;        /* Binary::BinaryArch */
+  uint32_t   bits;
+  uint32_t   pad;
+  uint64_t   entry;
+  SnapString filename;
+  SnapString type_str;
+  SnapString arch_str;
+  SnapTable  strings;     /* the string pool, in bytes */
+  SnapTable  sections;
+  SnapTable  segments;
+  SnapTable  symbols;
+  SnapTable  addr_keys;   /* SymbolAddrIndex */
+  SnapTable  addr_pred;
+  SnapTable  name_slots;  /* SymbolNameIndex */
+  SnapIndex  sec_index;
+  SnapIndex  seg_index;
+};
+
+struct SnapSection {
+  uint64_t   vma;
+  uint64_t   size;
+  uint64_t   offset;
+  uint64_t   data;        /* snapshot offset of the contents, 0 if not stored */
+  SnapString name;
+  uint8_t    type;        /* Section::SectionType */
+  uint8_t    zero_fill;
+  uint8_t    pad[2];
+  uint32_t   compress;
+  uint64_t   raw_size;
+};
+
+struct SnapSegment {
+  uint64_t   vma;
+  uint64_t   size;
+  uint64_t   file_size;
+  uint64_t   offset;
+  uint64_t   data;        /* as for SnapSection */
+  uint32_t   perms;
+  uint32_t   pad;
+};
+
+struct SnapSymbol {
+  uint64_t   addr;
+  uint64_t   size;
+  SnapString name;
+  uint8_t    type;        /* Symbol::SymbolType */
+  uint8_t    sources;
+  uint8_t    pad[6];
+};
+
+/* Moves the lookup indexes in and out of snapshots; a friend of the index
+ * classes, since it copies their arrays as they are */
+struct SnapshotCodec {
+  static void save(std::vector<uint8_t> &img, SnapHeader *hdr, Binary *bin);
+  static int  load(const uint8_t *img, size_t n, const SnapHeader *hdr, Binary *bin);
+
+  static void save_index(std::vector<uint8_t> &img, SnapIndex *si,
+                         const SectionIndex &idx);
+  static int  load_index(const uint8_t *img, size_t n, const SnapIndex *si,
+                         size_t nsecs, SectionIndex *idx);
+};
+
+int
+set_parse_cache(const char *dir, ParseCacheKey key)
+{
+  struct stat st;
+
+  if(!dir) {
+    parse_cache_dir.clear();
+    return 0;
+  }
+
+  if(stat(dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+    load_error("parse cache directory '%s' is not usable\n", dir);
+    return -1;
+  }
+
+  parse_cache_dir  = dir;
+  parse_cache_mode = key;
+
+  return 0;
+}
+
+/* 64-bit hash of n bytes, taken eight at a time over four independent
+ * lanes so that the multiplies overlap; not meant to resist attacks */
+static uint64_t
+hash_bytes(const uint8_t *p, size_t n)
+{
+  static const uint64_t prime = 0x9e3779b97f4a7c15ULL;
+  uint64_t h[4] = { 1, 2, 3, 4 }, w;
+  size_t i, j;
+
+  for(i = 0; i + 32 <= n; i += 32) {
+    for(j = 0; j < 4; j++) {
+      memcpy(&w, p + i + 8*j, sizeof(w));
+      h[j] = (h[j] ^ w) * prime;
+      h[j] ^= h[j] >> 32;
+    }
+  }
+  for(; i < n; i++) {
+    h[0] = (h[0] ^ p[i]) * prime;
+  }
+
+  w = n;
+  for(j = 0; j < 4; j++) {
+    w = (w ^ h[j]) * prime;
+    w ^= w >> 29;
+  }
+
+  return w;
+}
+
+/* Fills in the stat part of a key */
+static void
+stat_key(const struct stat *st, CacheKey *key)
+{
+  key->dev        = st->st_dev;
+  key->ino        = st->st_ino;
+  key->mtime_sec  = st->st_mtim.tv_sec;
+  key->mtime_nsec = st->st_mtim.tv_nsec;
+  key->size       = st->st_size;
+}
+
+/* Works out the key of fname, as loaded into bin with the given type, in
+ * the given mode. Returns -1 if the file cannot be looked at, leaving the
+ * error to whoever opens it next. */
+static int
+file_key(std::string &fname, Binary *bin, Binary::BinaryType type,
+         ParseCacheKey mode, CacheKey *key)
+{
+  int fd;
+  void *p;
+  struct stat st;
+
+  memset(key, 0, sizeof(*key));
+  key->mode  = mode;
+  key->type  = type;
+  key->flags = bin->load_flags & CACHE_KEY_FLAGS;
+
+  fd = open(fname.c_str(), O_RDONLY);
+  if(fd < 0) {
+    return -1;
+  }
+  if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return -1;
+  }
+  key->size = st.st_size;
+
+  if(mode == PARSE_CACHE_KEY_STAT) {
+    stat_key(&st, key);
+  } else if(bin->map) {
+    key->size = bin->map_size;
+    key->hash = hash_bytes(bin->map, bin->map_size);
+  } else if(st.st_size > 0) {
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(p == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+    key->hash = hash_bytes((uint8_t*)p, st.st_size);
+    munmap(p, st.st_size);
+  }
+  close(fd);
+
+  return 0;
+}
+
+/* Whether two stat keys name the same, unchanged file */
+static bool
+same_file(const CacheKey *a, const CacheKey *b)
+{
+  return a->dev == b->dev && a->ino == b->ino && a->size == b->size
+         && a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+static std::string
+parse_cache_path(const CacheKey *key)
+{
+  char name[32];
+
+  snprintf(name, sizeof(name), "/%016jx.bcache",
+           (uintmax_t)hash_bytes((const uint8_t*)key, sizeof(*key)));
+
+  return parse_cache_dir + name;
+}
+
+/* Appends n bytes to a snapshot image at the next aligned offset, which
+ * it returns */
+static uint64_t
+snap_append(std::vector<uint8_t> &img, const void *p, size_t n)
+{
+  uint64_t off;
+
+  img.resize((img.size() + SNAP_ALIGN - 1) & ~(size_t)(SNAP_ALIGN - 1), 0);
+  off = img.size();
+  img.insert(img.end(), (const uint8_t*)p, (const uint8_t*)p + n);
+
+  return off;
+}
+
+static void
+snap_put_table(std::vector<uint8_t> &img, SnapTable *t, const void *p,
+               size_t count, size_t size)
+{
+  t->off   = snap_append(img, p, count*size);
+  t->count = count;
+}
+
+/* Adds s to a snapshot's string pool, once per distinct pointer (names
+ * are interned, so that is once per distinct name) */
+static SnapString
+snap_put_string(std::vector<char> &pool,
+                std::unordered_map<const char*, uint32_t> &offsets, StrRef s)
+{
+  SnapString ss;
+
+  ss.len = s.size();
+  auto it = offsets.find(s.data());
+  if(it != offsets.end()) {
+    ss.off = it->second;
+    return ss;
+  }
+
+  ss.off = pool.size();
+  pool.insert(pool.end(), s.data(), s.data() + s.size());
+  pool.push_back('\0');
+  offsets[s.data()] = ss.off;
+
+  return ss;
+}
+
+/* Returns table t of a snapshot of n bytes, or NULL if it does not fit */
+static const void*
+snap_get_table(const uint8_t *img, size_t n, const SnapTable &t, size_t size)
+{
+  if(t.off % 8 || t.off > n || t.count > (n - t.off) / size) {
+    return NULL;
+  }
+
+  return img + t.off;
+}
+
+static bool
+snap_get_string(const char *pool, uint64_t size, SnapString s, StrRef *str)
+{
+  if(s.off >= size || s.len >= size - s.off || pool[s.off + s.len] != '\0') {
+    return false;
+  }
+  *str = StrRef(pool + s.off, s.len);
+
+  return true;
+}
+
+void
+SnapshotCodec::save(std::vector<uint8_t> &img, SnapHeader *hdr, Binary *bin)
+{
+  SymbolAddrIndex &ai = bin->sym_by_addr;
+  SymbolNameIndex &ni = bin->sym_by_name;
+
+  snap_put_table(img, &hdr->addr_keys, ai.keys.data(), ai.keys.size(), sizeof(ai.keys[0]));
+  snap_put_table(img, &hdr->addr_pred, ai.pred.data(), ai.pred.size(), sizeof(ai.pred[0]));
+  snap_put_table(img, &hdr->name_slots, ni.slots.data(), ni.slots.size(),
+                 sizeof(ni.slots[0]));
+  save_index(img, &hdr->sec_index, bin->sec_index);
+  save_index(img, &hdr->seg_index, bin->seg_index);
+}
+
+void
+SnapshotCodec::save_index(std::vector<uint8_t> &img, SnapIndex *si,
+                          const SectionIndex &idx)
+{
+  unsigned i;
+
+  snap_put_table(img, &si->ranges, idx.ranges.data(), idx.ranges.size(),
+                 sizeof(idx.ranges[0]));
+  snap_put_table(img, &si->pages, idx.pages.data(), idx.pages.size(),
+                 sizeof(idx.pages[0]));
+  si->base  = idx.base;
+  si->span  = idx.span;
+  si->shift = idx.shift;
+  for(i = 0; i < SectionIndex::SEC_ID_MAX; i++) {
+    si->ids[i] = idx.ids[i];
+  }
+}
+
+/* Restores the indexes over bin's tables, which must already be filled
+ * in. Every symbol and section number is checked, since lookups use them
+ * as they are. */
+int
+SnapshotCodec::load(const uint8_t *img, size_t n, const SnapHeader *hdr, Binary *bin)
+{
+  size_t i;
+  long nsyms;
+  bool free_slot;
+  const uint64_t *keys;
+  const SymbolAddrIndex::Pred *pred;
+  const SymbolNameIndex::Slot *slots;
+
+  keys  = (const uint64_t*)snap_get_table(img, n, hdr->addr_keys, sizeof(*keys));
+  pred  = (const SymbolAddrIndex::Pred*)snap_get_table(img, n, hdr->addr_pred,
+                                                       sizeof(*pred));
+  slots = (const SymbolNameIndex::Slot*)snap_get_table(img, n, hdr->name_slots,
+                                                       sizeof(*slots));
+  if(!keys || !pred || !slots || hdr->addr_keys.count != hdr->addr_pred.count
+     || (hdr->name_slots.count & (hdr->name_slots.count - 1))) {
+    return -1;
+  }
+
+  nsyms = bin->symbols.size();
+  for(i = 0; i < hdr->addr_pred.count; i++) {
+    if(pred[i].sym < -1 || pred[i].sym >= nsyms) return -1;
+  }
+  /* A name lookup runs until it finds a free slot */
+  free_slot = (hdr->name_slots.count == 0);
+  for(i = 0; i < hdr->name_slots.count; i++) {
+    if(slots[i].sym >= nsyms) return -1;
+    if(slots[i].sym < 0) free_slot = true;
+  }
+  if(!free_slot) {
+    return -1;
+  }
+
+  if(load_index(img, n, &hdr->sec_index, bin->sections.size(), &bin->sec_index) < 0
+     || load_index(img, n, &hdr->seg_index, bin->segments.size(), &bin->seg_index) < 0) {
+    return -1;
+  }
+
+  bin->sym_by_addr.keys.assign(keys, keys + hdr->addr_keys.count);
+  bin->sym_by_addr.pred.assign(pred, pred + hdr->addr_pred.count);
+  bin->sym_by_name.slots.assign(slots, slots + hdr->name_slots.count);
+
+  return 0;
+}
+
+int
+SnapshotCodec::load_index(const uint8_t *img, size_t n, const SnapIndex *si,
+                          size_t nsecs, SectionIndex *idx)
+{
+  size_t i, npages, nranges;
+  const SectionIndex::Range *ranges;
+  const uint32_t *pages;
+
+  ranges = (const SectionIndex::Range*)snap_get_table(img, n, si->ranges, sizeof(*ranges));
+  pages  = (const uint32_t*)snap_get_table(img, n, si->pages, sizeof(*pages));
+  if(!ranges || !pages || si->shift >= 64) {
+    return -1;
+  }
+
+  /* Lookups rely on the sentinel range to stop their scan */
+  nranges = si->ranges.count;
+  npages  = si->span ? ((si->span - 1) >> si->shift) + 1 : 0;
+  if(si->pages.count != npages
+     || (npages && (nranges == 0 || ranges[nranges - 1].end != UINT64_MAX))) {
+    return -1;
+  }
+  for(i = 0; i < nranges; i++) {
+    if(ranges[i].sec < -1 || ranges[i].sec >= (long)nsecs) return -1;
+  }
+  for(i = 0; i < npages; i++) {
+    if(pages[i] >= nranges) return -1;
+  }
+  for(i = 0; i < SectionIndex::SEC_ID_MAX; i++) {
+    if(si->ids[i] < -1 || si->ids[i] >= (int64_t)nsecs) return -1;
+  }
+
+  idx->ranges.assign(ranges, ranges + nranges);
+  idx->pages.assign(pages, pages + npages);
+  idx->base  = si->base;
+  idx->span  = si->span;
+  idx->shift = si->shift;
+  for(i = 0; i < SectionIndex::SEC_ID_MAX; i++) {
+    idx->ids[i] = si->ids[i];
+  }
+
+  return 0;
+}
+
+/* Lays bin out as a snapshot in img. key identifies the file it came from.
+ * Without with_bytes, every section must have its contents verbatim in
+ * that file (BFD may have had to decode some). */
+static int
+build_snapshot(Binary *bin, const CacheKey *key, bool with_bytes,
+               std::vector<uint8_t> &img)
+{
+  size_t i, nbytes;
+  uint8_t *bytes;
+  SnapHeader hdr;
+  std::vector<char> pool;
+  std::vector<SnapSection> secs;
+  std::vector<SnapSegment> segs;
+  std::vector<SnapSymbol> syms;
+  std::unordered_map<const char*, uint32_t> offsets;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+  hdr.version    = SNAP_VERSION;
+  hdr.byte_order = SNAP_BYTE_ORDER;
+  hdr.word_size  = sizeof(long);
+  hdr.has_bytes  = with_bytes;
+  hdr.key        = *key;
+  hdr.type       = bin->type;
+  hdr.arch       = bin->arch;
+  hdr.bits       = bin->bits;
+  hdr.entry      = bin->entry;
+  hdr.filename   = snap_put_string(pool, offsets, StrRef(bin->filename.c_str(),
+                                                         bin->filename.size()));
+  hdr.type_str   = snap_put_string(pool, offsets, StrRef(bin->type_str.c_str(),
+                                                         bin->type_str.size()));
+  hdr.arch_str   = snap_put_string(pool, offsets, StrRef(bin->arch_str.c_str(),
+                                                         bin->arch_str.size()));
+
+  nbytes = sizeof(hdr);
+  if(with_bytes) {
+    for(auto &sec : bin->sections) {
+      if(!sec.zero_fill) nbytes += sec.size + SNAP_ALIGN;
+    }
+    for(auto &seg : bin->segments) {
+      nbytes += seg.file_size + SNAP_ALIGN;
+    }
+  }
+  img.reserve(nbytes);
+  img.assign(sizeof(hdr), 0);
+
+  secs.resize(bin->sections.size());
+  for(i = 0; i < bin->sections.size(); i++) {
+    Section &sec = bin->sections[i];
+    secs[i].vma       = sec.vma;
+    secs[i].size      = sec.size;
+    secs[i].offset    = sec.offset;
+    secs[i].name      = snap_put_string(pool, offsets, sec.name);
+    secs[i].type      = sec.type;
+    secs[i].zero_fill = sec.zero_fill;
+    secs[i].compress  = sec.compress;
+    secs[i].raw_size  = sec.raw_size;
+    if(sec.zero_fill) {
+      continue;
+    }
+    if(with_bytes) {
+      bytes = sec.size ? sec.get_bytes() : NULL;
+      if(sec.size && !bytes) return -1;
+      secs[i].data = snap_append(img, bytes, sec.size);
+    } else if(sec.offset == 0 && sec.size) {
+      return -1;
+    }
+  }
+
+  segs.resize(bin->segments.size());
+  for(i = 0; i < bin->segments.size(); i++) {
+    Segment &seg = bin->segments[i];
+    segs[i].vma       = seg.vma;
+    segs[i].size      = seg.size;
+    segs[i].file_size = seg.file_size;
+    segs[i].offset    = seg.offset;
+    segs[i].perms     = seg.perms;
+    if(with_bytes && seg.file_size) {
+      if(!(bytes = seg.get_bytes())) return -1;
+      segs[i].data = snap_append(img, bytes, seg.file_size);
+    }
+  }
+
+  syms.resize(bin->symbols.size());
+  for(i = 0; i < bin->symbols.size(); i++) {
+    Symbol &sym = bin->symbols[i];
+    syms[i].addr    = sym.addr;
+    syms[i].size    = sym.size;
+    syms[i].name    = snap_put_string(pool, offsets, sym.name);
+    syms[i].type    = sym.type;
+    syms[i].sources = sym.sources;
+  }
+
+  if(pool.size() > UINT32_MAX) {
+    return -1;
+  }
+
+  snap_put_table(img, &hdr.sections, secs.data(), secs.size(), sizeof(secs[0]));
+  snap_put_table(img, &hdr.segments, segs.data(), segs.size(), sizeof(segs[0]));
+  snap_put_table(img, &hdr.symbols, syms.data(), syms.size(), sizeof(syms[0]));
+  SnapshotCodec::save(img, &hdr, bin);
+  snap_put_table(img, &hdr.strings, pool.data(), pool.size(), 1);
+
+  hdr.size = img.size();
+  memcpy(img.data(), &hdr, sizeof(hdr));
+
+  return 0;
+}
+
+/* Fills bin in from the snapshot image p of n bytes, checking that all of
+ * it is in bounds. On success bin holds on to the image (Binary::snap),
+ * which its names and any stored contents point into; on failure the
+ * image is left to the caller. */
+static int
+load_snapshot_image(Binary *bin, uint8_t *p, size_t n)
+{
+  size_t i;
+  StrRef filename, type_str, arch_str;
+  const char *pool;
+  const SnapHeader *hdr;
+  const SnapSection *secs;
+  const SnapSegment *segs;
+  const SnapSymbol *syms;
+  Section *sec;
+  Segment *seg;
+  Symbol *sym;
+
+  hdr = (const SnapHeader*)p;
+  if(n < sizeof(*hdr) || memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic))
+     || hdr->version != SNAP_VERSION || hdr->byte_order != SNAP_BYTE_ORDER
+     || hdr->word_size != sizeof(long) || hdr->size != n) {
+    return -1;
+  }
+
+  pool = (const char*)snap_get_table(p, n, hdr->strings, 1);
+  secs = (const SnapSection*)snap_get_table(p, n, hdr->sections, sizeof(*secs));
+  segs = (const SnapSegment*)snap_get_table(p, n, hdr->segments, sizeof(*segs));
+  syms = (const SnapSymbol*)snap_get_table(p, n, hdr->symbols, sizeof(*syms));
+  if(!pool || !secs || !segs || !syms
+     || !snap_get_string(pool, hdr->strings.count, hdr->filename, &filename)
+     || !snap_get_string(pool, hdr->strings.count, hdr->type_str, &type_str)
+     || !snap_get_string(pool, hdr->strings.count, hdr->arch_str, &arch_str)) {
+    return -1;
+  }
+
+  bin->filename = filename;
+  bin->type     = (Binary::BinaryType)hdr->type;
+  bin->type_str = type_str;
+  bin->arch     = (Binary::BinaryArch)hdr->arch;
+  bin->arch_str = arch_str;
+  bin->bits     = hdr->bits;
+  bin->entry    = hdr->entry;
+
+  bin->sections.reserve(hdr->sections.count);
+  for(i = 0; i < hdr->sections.count; i++) {
+    bin->sections.push_back(Section());
+    sec = &bin->sections.back();
+
+    sec->binary    = bin;
+    sec->type      = (Section::SectionType)secs[i].type;
+    sec->vma       = secs[i].vma;
+    sec->size      = secs[i].size;
+    sec->offset    = secs[i].offset;
+    sec->zero_fill = secs[i].zero_fill;
+    sec->compress  = secs[i].compress;
+    sec->raw_size  = secs[i].raw_size;
+    if(!snap_get_string(pool, hdr->strings.count, secs[i].name, &sec->name)) {
+      goto fail;
+    }
+    if(sec->compress && !inflated_size_ok(sec->raw_size, sec->size)) {
+      goto fail;
+    }
+    if(secs[i].data) {
+      if(secs[i].data > n || secs[i].size > n - secs[i].data) goto fail;
+      sec->bytes = p + secs[i].data;
+    }
+  }
+
+  bin->segments.reserve(hdr->segments.count);
+  for(i = 0; i < hdr->segments.count; i++) {
+    bin->segments.push_back(Segment());
+    seg = &bin->segments.back();
+
+    seg->binary    = bin;
+    seg->perms     = segs[i].perms;
+    seg->vma       = segs[i].vma;
+    seg->size      = segs[i].size;
+    seg->file_size = segs[i].file_size;
+    seg->offset    = segs[i].offset;
+    if(seg->file_size > seg->size) {
+      goto fail;
+    }
+    if(segs[i].data) {
+      if(segs[i].data > n || segs[i].file_size > n - segs[i].data) goto fail;
+      seg->bytes = p + segs[i].data;
+    }
+  }
+
+  bin->symbols.reserve(hdr->symbols.count);
+  for(i = 0; i < hdr->symbols.count; i++) {
+    bin->symbols.push_back(Symbol());
+    sym = &bin->symbols.back();
+
+    sym->type    = (Symbol::SymbolType)syms[i].type;
+    sym->sources = syms[i].sources;
+    sym->addr    = syms[i].addr;
+    sym->size    = syms[i].size;
+    if(!snap_get_string(pool, hdr->strings.count, syms[i].name, &sym->name)) {
+      goto fail;
+    }
+  }
+
+  if(SnapshotCodec::load(p, n, hdr, bin) < 0) {
+    goto fail;
+  }
+
+  bin->snap      = p;
+  bin->snap_size = n;
+
+  return 0;
+
+fail:
+  bin->sections.clear();
+  bin->segments.clear();
+  bin->symbols.clear();
+
+  return -1;
+}
+
+/* Brings in the section and segment contents that a snapshot left in the
+ * file it was taken of, which is known to be size bytes */
+static int
+load_snapshot_contents(Binary *bin, uint64_t size)
+{
+  int ret;
+  bool tmpmap;
+  uint64_t len;
+
+  /* load_sections_native() copies without checking the bounds */
+  for(auto &sec : bin->sections) {
+    len = sec.compress ? sec.raw_size : sec.size;
+    if(!sec.zero_fill && (sec.offset > size || len > size - sec.offset)) {
+      return -1;
+    }
+  }
+  for(auto &seg : bin->segments) {
+    if(seg.offset > size || seg.file_size > size - seg.offset) {
+      return -1;
+    }
+  }
+
+  /* As in load_binary_native(), a mapping is only needed for the copy */
+  tmpmap = !bin->map && !(bin->load_flags & Binary::LOAD_F_LAZY);
+  if(tmpmap && map_binary(bin->filename, bin) < 0) {
+    return -1;
+  }
+
+  if(bin->map && bin->map_size != size) {
+    ret = -1;
+  } else {
+    ret = load_sections_native(bin);
+  }
+
+  if(tmpmap) {
+    unmap_binary(bin);
+  }
+
+  return ret;
+}
+
+/* Maps all of fname read-only; returns NULL (with errno set) on failure */
+static uint8_t*
+map_snapshot_file(const std::string &fname, size_t *size)
+{
+  int fd;
+  void *p;
+  struct stat st;
+
+  fd = open(fname.c_str(), O_RDONLY);
+  if(fd < 0) {
+    return NULL;
+  }
+  if(fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+  if(st.st_size <= 0) {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(p == MAP_FAILED) {
+    return NULL;
+  }
+  *size = st.st_size;
+
+  return (uint8_t*)p;
+}
+
+/* Writes data to path by way of a temporary file next to it that is then
+ * renamed into place, so that readers (in this process or any other)
+ * never see half a file */
+static int
+write_file_atomic(const std::string &path, const std::vector<uint8_t> &data)
+{
+  int fd;
+  ssize_t n;
+  size_t done;
+  std::string tmp;
+
+  tmp = path + ".XXXXXX";
+  fd = mkstemp(&tmp[0]);
+  if(fd < 0) {
+    load_error("failed to create '%s' (%s)\n", tmp.c_str(), strerror(errno));
+    return -1;
+  }
+
+  for(done = 0; done < data.size(); done += n) {
+    n = write(fd, data.data() + done, data.size() - done);
+    if(n < 0 && errno == EINTR) {
+      n = 0;
+      continue;
+    }
+    if(n <= 0) {
+      load_error("failed to write '%s' (%s)\n", tmp.c_str(), strerror(errno));
+      goto fail;
+    }
+  }
+
+  if(close(fd) < 0 || rename(tmp.c_str(), path.c_str()) < 0) {
+    fd = -1;
+    load_error("failed to write '%s' (%s)\n", path.c_str(), strerror(errno));
+    goto fail;
+  }
+
+  return 0;
+
+fail:
+  if(fd >= 0) close(fd);
+  unlink(tmp.c_str());
+
+  return -1;
+}
+
+/* Fills bin in from the parse cache entry for key, if there is a valid
+ * one, and brings in the section contents as the load flags say. Returns
+ * 0 on a hit; on a miss bin is left empty for the backend. */
+static int
+load_binary_cached(std::string &fname, Binary *bin, const CacheKey *key)
+{
+  size_t n;
+  uint8_t *p;
+  const SnapHeader *hdr;
+
+  p = map_snapshot_file(parse_cache_path(key), &n);
+  if(!p) {
+    return -1;
+  }
+
+  /* A stale or damaged entry is just a miss */
+  hdr = (const SnapHeader*)p;
+  if(n < sizeof(*hdr) || memcmp(&hdr->key, key, sizeof(*key)) || hdr->has_bytes
+     || load_snapshot_image(bin, p, n) < 0) {
+    munmap(p, n);
+    return -1;
+  }
+
+  /* With content keys the same entry serves every copy of the file */
+  bin->filename = std::string(fname);
+  if(load_snapshot_contents(bin, key->size) < 0) {
+    clear_binary(bin);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Writes bin to the parse cache as the entry for key */
+static int
+store_binary_cached(Binary *bin, const CacheKey *key)
+{
+  std::vector<uint8_t> img;
+
+  if(build_snapshot(bin, key, false, img) < 0) {
+    return -1;
+  }
+
+  return write_file_atomic(parse_cache_path(key), img);
+}
+
+int
+save_snapshot(Binary *bin, std::string &fname, bool with_bytes)
+{
+  CacheKey key;
+  std::vector<uint8_t> img;
+
+  /* Without the contents, load_snapshot() goes back to the original file
+   * and needs to be able to tell whether it has changed */
+  if(file_key(bin->filename, bin, bin->type, PARSE_CACHE_KEY_STAT, &key) < 0) {
+    if(!with_bytes) {
+      load_error("cannot snapshot '%s' without its section contents\n",
+                 bin->filename.c_str());
+      return -1;
+    }
+    memset(&key, 0, sizeof(key));
+  }
+
+  if(build_snapshot(bin, &key, with_bytes, img) < 0) {
+    load_error("failed to snapshot '%s'\n", bin->filename.c_str());
+    return -1;
+  }
+
+  return write_file_atomic(fname, img);
+}
+
+int
+load_snapshot(std::string &fname, Binary *bin, int flags)
+{
+  size_t n;
+  uint8_t *p;
+  CacheKey key;
+  const SnapHeader *hdr;
+  ErrorScope errors(&bin->error);
+
+  p = map_snapshot_file(fname, &n);
+  if(!p) {
+    load_error("failed to open snapshot '%s' (%s)\n",
+               fname.c_str(), strerror(errno));
+    return -1;
+  }
+
+  bin->load_flags = flags;
+  if(load_snapshot_image(bin, p, n) < 0) {
+    load_error("'%s' is not a valid snapshot\n", fname.c_str());
+    munmap(p, n);
+    return -1;
+  }
+
+  hdr = (const SnapHeader*)p;
+  if(!hdr->has_bytes) {
+    if(file_key(bin->filename, bin, bin->type, PARSE_CACHE_KEY_STAT, &key) < 0
+       || !same_file(&key, &hdr->key)) {
+      load_error("'%s' has changed since snapshot '%s' was taken\n",
+                 bin->filename.c_str(), fname.c_str());
+      goto fail;
+    }
+    if((flags & Binary::LOAD_F_MMAP) && map_binary(bin->filename, bin) < 0) {
+      goto fail;
+    }
+    if(load_snapshot_contents(bin, hdr->key.size) < 0) {
+      goto fail;
+    }
+  }
+
+  if(flags & Binary::LOAD_F_SYMBOL_COLUMNS) {
+    bin->symcols.build(bin->symbols);
+  }
+
+  return 0;
+
+fail:
+  unload_binary(bin);
+
+  return -1;
+}
+
+/* Section store for LOAD_F_DEDUP: contents copied out of any number of
+ * binaries are kept once per distinct content, found by hash and size
+ * and confirmed byte for byte, and freed when the last Binary holding a
+ * reference lets go of it */
+struct SectionBytes {
+  uint64_t  hash;
+  size_t    size;
+  size_t    refs;
+  uint8_t  *data;
+};
+
+static std::mutex dedup_lock;
+static std::unordered_multimap<uint64_t, SectionBytes*> dedup_store;
+static uint64_t   dedup_inserts;  /* bumped on every insert, under dedup_lock */
+
+/* Drops a reference to sb, freeing it with the last one; call with
+ * dedup_lock held */
+static void
+put_section_bytes(SectionBytes *sb)
+{
+  if(--sb->refs > 0) {
+    return;
+  }
+
+  auto range = dedup_store.equal_range(sb->hash);
+  for(auto it = range.first; it != range.second; it++) {
+    if(it->second == sb) {
+      dedup_store.erase(it);
+      break;
+    }
+  }
+  stat_dedup_stored -= sb->size;
+  free(sb->data);
+  free(sb);
+}
+
+/* Returns the store's copy of the size bytes at src, making one if there
+ * is none yet, and records the reference in bin; NULL if out of memory.
+ * The lock is only held to look entries up and insert them: candidates
+ * are pinned with a reference and compared outside it, and a new copy is
+ * made outside it too, then inserted unless the store has changed in the
+ * meantime, in which case the lookup starts over. */
+static uint8_t*
+dedup_bytes(Binary *bin, const uint8_t *src, uint64_t size)
+{
+  uint64_t h, inserts;
+  SectionBytes *sb, *copy;
+  std::vector<SectionBytes*> pinned;
+  std::unique_lock<std::mutex> guard(dedup_lock, std::defer_lock);
+
+  h = hash_bytes(src, size);
+  copy = NULL;
+
+  for(;;) {
+    guard.lock();
+    inserts = dedup_inserts;
+    pinned.clear();
+    auto range = dedup_store.equal_range(h);
+    for(auto it = range.first; it != range.second; it++) {
+      if(it->second->size == size) {
+        it->second->refs++;
+        pinned.push_back(it->second);
+      }
+    }
+    guard.unlock();
+
+    sb = NULL;
+    for(auto *p : pinned) {
+      if(!sb && !memcmp(p->data, src, size)) {
+        sb = p;
+      }
+    }
+
+    guard.lock();
+    for(auto *p : pinned) {
+      if(p != sb) put_section_bytes(p);
+    }
+    if(sb) {
+      /* Our pin on sb becomes bin's reference */
+      guard.unlock();
+      if(copy) {
+        free(copy->data);
+        free(copy);
+      }
+      goto found;
+    }
+    if(copy && inserts == dedup_inserts) {
+      dedup_store.insert(std::make_pair(h, copy));
+      dedup_inserts++;
+      stat_dedup_stored += size;
+      guard.unlock();
+      sb = copy;
+      goto found;
+    }
+    guard.unlock();
+
+    if(!copy) {
+      copy = (SectionBytes*)malloc(sizeof(*copy));
+      if(!copy) {
+        return NULL;
+      }
+      copy->data = (uint8_t*)malloc(size ? size : 1);
+      if(!copy->data) {
+        free(copy);
+        return NULL;
+      }
+      memcpy(copy->data, src, size);
+      copy->hash = h;
+      copy->size = size;
+      copy->refs = 1;
+    }
+  }
+
+found:
+  bin->dedup_refs.push_back(sb);
+  stat_dedup_bytes += size;
+
+  return sb->data;
+}
+
+/* Drops all of bin's references into the section store */
+static void
+release_dedup_bytes(Binary *bin)
+{
+  if(bin->dedup_refs.empty()) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(dedup_lock);
+
+  for(auto *sb : bin->dedup_refs) {
+    stat_dedup_bytes -= sb->size;
+    put_section_bytes(sb);
+  }
+  bin->dedup_refs.clear();
+}
+
+/* Copies size bytes of section or segment contents from src into the
+ * Binary's arena or, under LOAD_F_DEDUP, the section store. Returns NULL
+ * if out of memory. */
+static uint8_t*
+copy_bytes(Binary *bin, const uint8_t *src, uint64_t size)
+{
+  uint8_t *p;
+
+  if(bin->load_flags & Binary::LOAD_F_DEDUP) {
+    return dedup_bytes(bin, src, size);
+  }
+
+  p = (uint8_t*)bin->arena.alloc(size);
+  if(p) {
+    memcpy(p, src, size);
+  }
+
+  return p;
+}
+
+/* Shared binaries, see get_shared_binary(). An entry is created as soon
+ * as a load starts, so that others asking for the same file find it and
+ * wait on shared_loaded instead of loading it again. */
+#define SHARED_BINARY_BUDGET  ((size_t)1 << 30)
+
+struct SharedBinary {
+  std::string   key;      /* file name, type and load flags */
+  CacheKey      file;     /* stat key of the file that was loaded */
+  BinaryHandle  bin;      /* empty while loading, or if the load failed */
+  bool          loading;
+  size_t        bytes;    /* counted against the budget */
+};
+
+typedef std::list<std::shared_ptr<SharedBinary> > SharedList;
+
+static std::mutex              shared_lock;
+static std::condition_variable shared_loaded;
+static SharedList              shared_lru;  /* most recently used first */
+static std::unordered_map<std::string, SharedList::iterator> shared_index;
+static size_t                  shared_budget = SHARED_BINARY_BUDGET;
+
+/* What a loaded Binary holds on to. File and snapshot mappings count in
+ * full, since their pages stay resident for as long as they are used. */
+static size_t
+binary_footprint(Binary *bin)
+{
+  size_t shared = 0;
+
+  /* Contents in the section store count in full for every Binary */
+  for(auto *sb : bin->dedup_refs) {
+    shared += sb->size;
+  }
+
+  return shared + bin->arena.bytes() + bin->strings.bytes() + bin->map_size + bin->snap_size
+         + bin->sections.capacity()*sizeof(Section)
+         + bin->segments.capacity()*sizeof(Segment)
+         + bin->symbols.capacity()*sizeof(Symbol) + bin->symcols.bytes()
+         + bin->sec_index.bytes() + bin->seg_index.bytes()
+         + bin->sym_by_addr.bytes() + bin->sym_by_name.bytes();
+}
+
+/* Takes an entry out of the cache; call with shared_lock held. The entry
+ * goes to the caller's dropped list rather than away: it may hold the
+ * last reference to its Binary, and tearing that down (unmapping, freeing
+ * the arena) is left for after the lock is released. */
+static void
+drop_shared_binary(SharedList::iterator pos, SharedList *dropped)
+{
+  stat_shared_bytes -= (*pos)->bytes;
+  shared_index.erase((*pos)->key);
+  dropped->splice(dropped->end(), shared_lru, pos);
+}
+
+/* Drops least recently used entries until the cache fits its budget,
+ * skipping those still being loaded; call with shared_lock held */
+static void
+evict_shared_binaries(SharedList *dropped)
+{
+  SharedList::iterator pos, victim;
+
+  pos = shared_lru.end();
+  while(stat_shared_bytes > shared_budget && pos != shared_lru.begin()) {
+    victim = --pos;
+    if((*victim)->loading) {
+      continue;
+    }
+    ++pos;
+    drop_shared_binary(victim, dropped);
+    stat_shared_evictions++;
+  }
+}
+
+BinaryHandle
+get_shared_binary(std::string &fname, Binary::BinaryType type, int flags)
+{
+  struct stat st;
+  std::string key;
+  CacheKey file;
+  BinaryHandle bin;
+  SharedList dropped;  /* destroyed after guard, so outside the lock */
+  std::shared_ptr<SharedBinary> e;
+  std::unordered_map<std::string, SharedList::iterator>::iterator it;
+
+  /* Nothing may be filled in behind the back of other threads */
+  flags &= ~Binary::LOAD_F_LAZY;
+
+  if(stat(fname.c_str(), &st) < 0) {
+    load_error("failed to stat binary '%s' (%s)\n",
+               fname.c_str(), strerror(errno));
+    return BinaryHandle();
+  }
+  stat_key(&st, &file);
+
+  key = fname;
+  key += '\0';
+  key += std::to_string(type) + ":" + std::to_string(flags);
+
+  std::unique_lock<std::mutex> guard(shared_lock);
+
+  it = shared_index.find(key);
+  if(it != shared_index.end()) {
+    e = *it->second;
+    if(e->loading) {
+      /* Whatever that load comes to is the answer here too */
+      stat_shared_coalesced++;
+      while(e->loading) {
+        shared_loaded.wait(guard);
+      }
+      return e->bin;
+    }
+    if(same_file(&e->file, &file)) {
+      stat_shared_hits++;
+      shared_lru.splice(shared_lru.begin(), shared_lru, it->second);
+      return e->bin;
+    }
+    /* The file has changed; handles to the old Binary stay valid */
+    drop_shared_binary(it->second, &dropped);
+  }
+
+  stat_shared_misses++;
+  e = std::make_shared<SharedBinary>();
+  e->key     = key;
+  e->file    = file;
+  e->loading = true;
+  e->bytes   = 0;
+  shared_lru.push_front(e);
+  shared_index[key] = shared_lru.begin();
+  guard.unlock();
+
+  bin = std::make_shared<Binary>();
+  if(load_binary(fname, bin.get(), type, flags) < 0) {
+    bin.reset();
+  } else {
+    /* Zero-fill and compressed contents are handed out on first use; do
+     * that now, while the Binary is still private to this thread */
+    decompress_sections(bin.get());
+    for(auto &sec : bin->sections) {
+      sec.get_bytes();
+    }
+    for(auto &seg : bin->segments) {
+      seg.get_bytes();
+    }
+  }
+
+  guard.lock();
+  e->loading = false;
+  e->bin     = bin;
+  if(bin) {
+    e->bytes = binary_footprint(bin.get());
+    stat_shared_bytes += e->bytes;
+    evict_shared_binaries(&dropped);
+  } else {
+    /* Do not cache the failure; the next caller tries again */
+    it = shared_index.find(key);
+    if(it != shared_index.end() && *it->second == e) {
+      drop_shared_binary(it->second, &dropped);
+    }
+  }
+  shared_loaded.notify_all();
+
+  return bin;
+}
+
+void
+set_shared_binary_budget(size_t bytes)
+{
+  SharedList dropped;
+  std::lock_guard<std::mutex> guard(shared_lock);
+
+  shared_budget = bytes;
+  evict_shared_binaries(&dropped);
+}
+
+void
+flush_shared_binaries()
+{
+  SharedList::iterator pos, victim;
+  SharedList dropped;
+  std::lock_guard<std::mutex> guard(shared_lock);
+
+  for(pos = shared_lru.begin(); pos != shared_lru.end(); ) {
+    victim = pos++;
+    if(!(*victim)->loading) {
+      drop_shared_binary(victim, &dropped);
+    }
+  }
+}
+
+static int
+map_binary(std::string &fname, Binary *bin)
+{
+  int fd;
+  struct stat st;
+  void *map;
+
+  fd = open(fname.c_str(), O_RDONLY);
+  if(fd < 0) {
+    load_error("failed to open binary '%s' (%s)\n",
+               fname.c_str(), strerror(errno));
+    return -1;
+  }
+
+  if(fstat(fd, &st) < 0 || st.st_size <= 0) {
+    load_error("failed to stat binary '%s'\n", fname.c_str());
+    close(fd);
+    return -1;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  /* The mapping stays valid after the descriptor is closed */
+  close(fd);
+  if(map == MAP_FAILED) {
+    load_error("failed to map binary '%s' (%s)\n",
+               fname.c_str(), strerror(errno));
+    return -1;
+  }
+
+  bin->map      = (uint8_t*)map;
+  bin->map_size = st.st_size;
+
+  return 0;
+}
+
+/* Points sec->bytes into the file mapping, checking the bounds first */
+static int
+map_section_bytes(Section *sec)
+{
+  Binary *bin = sec->binary;
+
+  if(sec->offset > bin->map_size || sec->size > bin->map_size - sec->offset) {
+    load_error("section '%s' extends past the end of the file\n",
+               sec->name.c_str());
+    return -1;
+  }
+  sec->bytes = bin->map + sec->offset;
+
+  return 0;
+}
+
+/* Points seg->bytes at the file-backed part of the segment in the file
+ * mapping, checking the bounds first */
+static int
+map_segment_bytes(Segment *seg)
+{
+  Binary *bin = seg->binary;
+
+  if(seg->offset > bin->map_size || seg->file_size > bin->map_size - seg->offset) {
+    load_error("segment at 0x%016jx extends past the end of the file\n",
+               seg->vma);
+    return -1;
+  }
+  seg->bytes = bin->map + seg->offset;
+
+  return 0;
+}
+
+/* Reads size bytes at offset in the binary's file into buf; what says
+ * what they are for error messages. Safe to call from any thread. */
+static int
+read_file_range(Binary *bin, uint64_t offset, uint64_t size,
+                const std::string &what, uint8_t *buf)
+{
+  int fd;
+  ssize_t n;
+  uint64_t done;
+
+  fd = open(bin->filename.c_str(), O_RDONLY);
+  if(fd < 0) {
+    load_error("failed to open binary '%s' (%s)\n",
+               bin->filename.c_str(), strerror(errno));
+    return -1;
+  }
+
+  for(done = 0; done < size; done += n) {
+    n = pread(fd, buf + done, size - done, offset + done);
+    if(n < 0 && errno == EINTR) {
+      n = 0;
+      continue;
+    }
+    if(n <= 0) {
+      load_error("failed to read %s (%s)\n",
+                 what.c_str(), n < 0 ? strerror(errno) : "unexpected EOF");
+      close(fd);
+      return -1;
+    }
+  }
+
+  close(fd);
+
+  return 0;
+}
+
+/* Reads size bytes at offset in the binary's file into its arena (or
+ * the section store); what says what they are for error messages */
+static int
+read_file_bytes(Binary *bin, uint64_t offset, uint64_t size,
+                const std::string &what, uint8_t **bytes)
+{
+  bool dedup;
+  uint8_t *buf;
+  std::vector<uint8_t> tmp;
+
+  /* The store only takes complete contents, so read them elsewhere first */
+  dedup = bin->load_flags & Binary::LOAD_F_DEDUP;
+  if(dedup) {
+    tmp.resize(size);
+    buf = tmp.data();
+  } else {
+    buf = (uint8_t*)bin->arena.alloc(size);
+  }
+  if(!buf && size) {
+    load_error("failed to allocate memory for %s of size %ju\n",
+               what.c_str(), size);
+    return -1;
+  }
+
+  if(read_file_range(bin, offset, size, what, buf) < 0) {
+    return -1;
+  }
+
+  if(dedup && !(buf = dedup_bytes(bin, buf, size))) {
+    load_error("failed to allocate memory for %s of size %ju\n",
+               what.c_str(), size);
+    return -1;
+  }
+  *bytes = buf;
+
+  return 0;
+}
+
+/* Inflates the raw_size bytes of zlib stream at src into the sec->size
+ * bytes at out, which it must fill exactly. zlib counts in 32 bits, so
+ * big sections are fed to it a piece at a time. */
+static int
+inflate_section(const Section *sec, const uint8_t *src, uint8_t *out)
+{
+  int ret;
+  uint64_t in_left, out_left;
+  z_stream zs;
+
+  if(sec->compress != ELFCOMPRESS_ZLIB) {
+    load_error("section '%s' uses unsupported compression (%u)\n",
+               sec->name.c_str(), sec->compress);
+    return -1;
+  }
+
+  memset(&zs, 0, sizeof(zs));
+  if(inflateInit(&zs) != Z_OK) {
+    load_error("failed to set up decompression of section '%s'\n",
+               sec->name.c_str());
+    return -1;
+  }
+
+  zs.next_in  = (Bytef*)src;
+  zs.next_out = (Bytef*)out;
+  in_left     = sec->raw_size;
+  out_left    = sec->size;
+  do {
+    if(!zs.avail_in) {
+      zs.avail_in = (uInt)std::min<uint64_t>(in_left, UINT_MAX);
+      in_left -= zs.avail_in;
+    }
+    if(!zs.avail_out) {
+      zs.avail_out = (uInt)std::min<uint64_t>(out_left, UINT_MAX);
+      out_left -= zs.avail_out;
+    }
+    ret = inflate(&zs, Z_NO_FLUSH);
+  } while(ret == Z_OK);
+  inflateEnd(&zs);
+
+  if(ret != Z_STREAM_END || out_left || zs.avail_out) {
+    load_error("failed to decompress section '%s' (%s)\n",
+               sec->name.c_str(), ret == Z_STREAM_END ? "wrong size"
+                                   : zs.msg ? zs.msg : "corrupt data");
+    return -1;
+  }
 
-int
-load_binary(std::string &fname, Binary *bin, Binary::BinaryType type)
+  return 0;
+}
+
+/* Inflates sec into out: straight from the file mapping if there is one,
+ * otherwise by way of a read of the compressed stream. Touches nothing
+ * but out, so workers can run it on different sections at once. */
+static int
+inflate_section_from_file(const Section *sec, uint8_t *out)
 {
-  switch(type) {
-  case Binary::BIN_TYPE_AUTO:
-  case Binary::BIN_TYPE_ELF: {
-    // Try with libelfmaster first, then fall back to BFD
-    const int ret = load_binary_lem(fname, bin);
-    if(ret == 0 || type == Binary::BIN_TYPE_ELF) {
-      return ret;
+  int ret;
+  uint8_t *raw;
+  Binary *bin = sec->binary;
+
+  if(bin->map) {
+    if(sec->offset > bin->map_size || sec->raw_size > bin->map_size - sec->offset) {
+      load_error("section '%s' extends past the end of the file\n",
+                 sec->name.c_str());
+      return -1;
     }
+    return inflate_section(sec, bin->map + sec->offset, out);
   }
 
-  case Binary::BIN_TYPE_PE:
-  default:
-    return load_binary_bfd(fname, bin, type);
+  raw = (uint8_t*)malloc(sec->raw_size ? sec->raw_size : 1);
+  if(!raw) {
+    load_error("failed to allocate memory for section '%s' of size %ju\n",
+               sec->name.c_str(), sec->raw_size);
+    return -1;
+  }
+  ret = -1;
+  if(read_file_range(bin, sec->offset, sec->raw_size,
+                     std::string("section '") + sec->name.c_str() + "'", raw) == 0) {
+    ret = inflate_section(sec, raw, out);
   }
+  free(raw);
+
+  return ret;
 }
 
-void
-unload_binary(Binary *bin)
+/* Inflates a compressed section into the Binary's arena (or the section
+ * store) and caches the result in sec->bytes */
+static int
+inflate_section_bytes(Section *sec)
+{
+  bool dedup;
+  uint8_t *buf, *tmp;
+  Binary *bin = sec->binary;
+
+  /* The store only takes complete contents, so inflate elsewhere first */
+  dedup = bin->load_flags & Binary::LOAD_F_DEDUP;
+  tmp = NULL;
+  if(dedup) {
+    buf = tmp = (uint8_t*)malloc(sec->size);
+  } else {
+    buf = (uint8_t*)bin->arena.alloc(sec->size);
+  }
+  if(!buf) {
+    load_error("failed to allocate memory for section '%s' of size %ju\n",
+               sec->name.c_str(), sec->size);
+    return -1;
+  }
+
+  if(inflate_section_from_file(sec, buf) < 0) {
+    goto fail;
+  }
+
+  if(dedup && !(buf = dedup_bytes(bin, buf, sec->size))) {
+    load_error("failed to allocate memory for section '%s' of size %ju\n",
+               sec->name.c_str(), sec->size);
+    goto fail;
+  }
+  free(tmp);
+  sec->bytes = buf;
+
+  return 0;
+
+fail:
+  free(tmp);
+
+  return -1;
+}
+
+/* Describes the contents of SHF_COMPRESSED section sec, given the ELF
+ * compression header at its start in host byte order (as libelfmaster
+ * hands it out): offset and raw_size then cover the stream after the
+ * header and size becomes what it inflates to */
+static int
+read_compression_header(Binary *bin, Section *sec, const uint8_t *hdr)
+{
+  Elf32_Chdr chdr32;
+  Elf64_Chdr chdr64;
+  uint64_t n;
+
+  n = (bin->bits == 32) ? sizeof(chdr32) : sizeof(chdr64);
+  if(sec->size < n) {
+    load_error("section '%s' is too small for its compression header\n",
+               sec->name.c_str());
+    return -1;
+  }
+
+  if(bin->bits == 32) {
+    memcpy(&chdr32, hdr, sizeof(chdr32));
+    sec->compress = chdr32.ch_type;
+    sec->raw_size = sec->size - n;
+    sec->size     = chdr32.ch_size;
+  } else {
+    memcpy(&chdr64, hdr, sizeof(chdr64));
+    sec->compress = chdr64.ch_type;
+    sec->raw_size = sec->size - n;
+    sec->size     = chdr64.ch_size;
+  }
+  sec->offset += n;
+
+  if(!inflated_size_ok(sec->raw_size, sec->size)) {
+    load_error("section '%s' claims an implausible size (%ju) when inflated\n",
+               sec->name.c_str(), sec->size);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Zero-fill (.bss, and the part of a segment past its file contents) is
+ * read from here instead of being allocated */
+#define ZERO_FILL_SIZE  (64*1024)
+static const uint8_t zero_fill[ZERO_FILL_SIZE] = { 0 };
+
+/* Returns size bytes of read-only zeros. Anything too big for the static
+ * block gets an anonymous mapping, which reads as the kernel's shared
+ * zero page and so costs address space but no memory. */
+static uint8_t*
+zero_fill_bytes(Binary *bin, uint64_t size)
+{
+  void *p;
+
+  if(size <= ZERO_FILL_SIZE) {
+    return (uint8_t*)zero_fill;
+  }
+
+  p = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(p == MAP_FAILED) {
+    load_error("failed to map %ju bytes of zero-fill (%s)\n",
+               size, strerror(errno));
+    return NULL;
+  }
+  bin->zero_maps.push_back(std::make_pair((uint8_t*)p, (size_t)size));
+
+  return (uint8_t*)p;
+}
+
+uint8_t*
+Section::get_bytes()
+{
+  if(!bytes && size && binary) {
+    if(zero_fill) {
+      bytes = zero_fill_bytes(binary, size);
+    } else if(compress) {
+      inflate_section_bytes(this);
+    } else if(binary->map) {
+      map_section_bytes(this);
+    } else {
+      read_file_bytes(binary, offset, size,
+                      std::string("section '") + name.c_str() + "'", &bytes);
+    }
+  }
+
+  return bytes;
+}
+
+uint8_t*
+Segment::get_bytes()
+{
+  char what[64];
+
+  if(!bytes && file_size && binary) {
+    if(binary->map) {
+      map_segment_bytes(this);
+    } else {
+      snprintf(what, sizeof(what), "segment at 0x%016jx", vma);
+      read_file_bytes(binary, offset, file_size, what, &bytes);
+    }
+  }
+
+  return bytes;
+}
+
+/* One section for decompress_sections(), with the buffer it goes to */
+struct InflateJob {
+  Section              *sec;
+  uint8_t              *out;
+  uint8_t              *tmp;  /* malloc'd to hold out under LOAD_F_DEDUP */
+  bool                  ok;
+};
+
+static void
+inflate_worker(std::vector<InflateJob> &jobs, std::atomic<size_t> &next)
+{
+  size_t i;
+
+  while((i = next++) < jobs.size()) {
+    jobs[i].ok = (inflate_section_from_file(jobs[i].sec, jobs[i].out) == 0);
+  }
+}
+
+int
+decompress_sections(Binary *bin, unsigned nthreads)
 {
+  size_t i;
+  int failed;
+  bool dedup;
+  InflateJob job = InflateJob();
+  std::atomic<size_t> next(0);
+  std::vector<InflateJob> jobs;
+  std::vector<std::thread> workers;
+
+  /* The workers only inflate; everything that touches the Binary (its
+   * arena, the section store) happens here, before and after them */
+  dedup = bin->load_flags & Binary::LOAD_F_DEDUP;
+  failed = 0;
   for(auto &sec : bin->sections) {
-    if(sec.bytes) {
-      free(sec.bytes);
-      sec.bytes = NULL;
+    if(!sec.compress || sec.bytes || !sec.size) {
+      continue;
+    }
+    job.sec = &sec;
+    job.ok  = false;
+    jobs.push_back(job);
+    if(dedup) {
+      jobs.back().out = jobs.back().tmp = (uint8_t*)malloc(sec.size);
+    } else {
+      jobs.back().out = (uint8_t*)bin->arena.alloc(sec.size);
+    }
+    if(!jobs.back().out) {
+      load_error("failed to allocate memory for section '%s' of size %ju\n",
+                 sec.name.c_str(), sec.size);
+      jobs.pop_back();
+      failed++;
+    }
+  }
+
+  if(!nthreads) {
+    nthreads = std::thread::hardware_concurrency();
+  }
+  if(!nthreads) {
+    nthreads = 1;
+  }
+  if(nthreads > jobs.size()) {
+    nthreads = jobs.size();
+  }
+
+  /* The calling thread is one of the workers */
+  for(i = 1; i < nthreads; i++) {
+    workers.push_back(std::thread(inflate_worker, std::ref(jobs), std::ref(next)));
+  }
+  inflate_worker(jobs, next);
+  for(auto &w : workers) {
+    w.join();
+  }
+
+  for(auto &j : jobs) {
+    if(j.ok && dedup) {
+      j.out = dedup_bytes(bin, j.out, j.sec->size);
+      if(!j.out) {
+        load_error("failed to allocate memory for section '%s' of size %ju\n",
+                   j.sec->name.c_str(), j.sec->size);
+      }
+    }
+    free(j.tmp);
+    if(!j.ok || !j.out) {
+      failed++;
+      continue;
+    }
+    j.sec->bytes = j.out;
+  }
+
+  return failed;
+}
+
+/* Makes the range around vaddr the one read_vaddr() hits without a
+ * lookup; returns false if vaddr has no section or segment behind it.
+ * Sections take precedence, segments fill in the gaps between them. */
+static bool
+resolve_vaddr(Binary *bin, uint64_t vaddr)
+{
+  long i;
+  uint64_t start, end, split;
+  uint8_t *bytes;
+  Segment *seg;
+
+  bin->vread_start = bin->vread_end = 0;
+  bin->vread_bytes = NULL;
+
+  if((i = bin->sec_index.lookup(vaddr, &start, &end)) >= 0) {
+    if(bin->sections[i].zero_fill) {
+      start = vaddr;
+      end   = std::min<uint64_t>(end - vaddr, ZERO_FILL_SIZE) + vaddr;
+      bin->vread_bytes = zero_fill;
+    } else if(!(bytes = bin->sections[i].get_bytes())) {
+      return false;
+    } else {
+      bin->vread_bytes = bytes + (start - bin->sections[i].vma);
+    }
+  } else if((i = bin->seg_index.lookup(vaddr, &start, &end)) >= 0) {
+    /* Only the stretch of the segment no section covers, or later reads
+     * within the window would skip over the sections */
+    bin->sec_index.clip_to_gap(vaddr, &start, &end);
+    seg   = &bin->segments[i];
+    split = seg->vma + seg->file_size;
+    if(vaddr < split) {
+      if(!(bytes = seg->get_bytes())) {
+        return false;
+      }
+      end = std::min(end, split);
+      bin->vread_bytes = bytes + (start - seg->vma);
+    } else {
+      start = vaddr;
+      end   = std::min<uint64_t>(end - vaddr, ZERO_FILL_SIZE) + vaddr;
+      bin->vread_bytes = zero_fill;
+    }
+  } else {
+    return false;
+  }
+
+  bin->vread_start = start;
+  bin->vread_end   = end;
+
+  return true;
+}
+
+const uint8_t*
+Binary::read_vaddr_slow(uint64_t vaddr, size_t len, uint8_t *buf)
+{
+  size_t done, n;
+
+  if(vaddr - vread_start >= vread_end - vread_start && !resolve_vaddr(this, vaddr)) {
+    return NULL;
+  }
+  if(len <= vread_end - vaddr) {
+    return vread_bytes + (vaddr - vread_start);
+  }
+
+  /* Straddles a section boundary (or an overlap), so gather a copy */
+  if(!buf) {
+    vread_buf.resize(len);
+    buf = vread_buf.data();
+  }
+  for(done = 0; done < len; done += n) {
+    if(done && !resolve_vaddr(this, vaddr + done)) {
+      return NULL;
+    }
+    n = std::min<uint64_t>(len - done, vread_end - (vaddr + done));
+    memcpy(buf + done, vread_bytes + (vaddr + done - vread_start), n);
+  }
+
+  return buf;
+}
+
+static void
+unmap_binary(Binary *bin)
+{
+  if(bin->map) {
+    /* Caller-supplied buffers are not ours to unmap */
+    if(!bin->map_external) {
+      munmap(bin->map, bin->map_size);
     }
+    bin->map          = NULL;
+    bin->map_size     = 0;
+    bin->map_external = false;
+  }
+}
+
+/* Section and segment copies all live in the Binary's arena, or the
+ * section store; bytes aliasing the file mapping go away with munmap
+ * instead */
+static void
+free_section_bytes(Binary *bin)
+{
+  for(auto &sec : bin->sections) {
+    sec.bytes = NULL;
+  }
+  for(auto &seg : bin->segments) {
+    seg.bytes = NULL;
+  }
+  for(auto &m : bin->zero_maps) {
+    munmap(m.first, m.second);
+  }
+  bin->zero_maps.clear();
+  release_dedup_bytes(bin);
+  bin->arena.reset();
+}
+
+static std::mutex bfd_lock;
+
+/* BFD I/O callbacks for binaries supplied in memory; the stream is the
+ * Binary whose map holds the caller's buffer */
+static void*
+bfd_mem_open(struct bfd *bfd_h, void *closure)
+{
+  return closure;
+}
+
+static file_ptr
+bfd_mem_pread(struct bfd *bfd_h, void *stream, void *buf, file_ptr nbytes,
+              file_ptr offset)
+{
+  Binary *bin = (Binary*)stream;
+
+  if(offset < 0 || (uint64_t)offset >= bin->map_size) {
+    return 0;
   }
+  if((uint64_t)nbytes > bin->map_size - offset) {
+    nbytes = bin->map_size - offset;
+  }
+  memcpy(buf, bin->map + offset, nbytes);
+
+  return nbytes;
+}
+
+static int
+bfd_mem_close(struct bfd *bfd_h, void *stream)
+{
+  return 0;
+}
+
+static int
+bfd_mem_stat(struct bfd *bfd_h, void *stream, struct stat *sb)
+{
+  memset(sb, 0, sizeof(*sb));
+  sb->st_mode = S_IFREG | 0444;
+  sb->st_size = ((Binary*)stream)->map_size;
+
+  return 0;
 }
 
 static bfd*
-open_bfd(std::string &fname)
+open_bfd(std::string &fname, Binary *bin)
 {
-  static int bfd_inited = 0;
+  static std::once_flag bfd_inited;
   bfd *bfd_h;
 
-  if(!bfd_inited) {
-    bfd_init();
-    bfd_inited = 1;
-  }
+  std::call_once(bfd_inited, bfd_init);
 
-  bfd_h = bfd_openr(fname.c_str(), NULL);
+  /* Start from a clean slate rather than whatever the last load left */
+  bfd_set_error(bfd_error_no_error);
+
+  if(bin->map_external) {
+    bfd_h = bfd_openr_iovec(fname.c_str(), NULL, bfd_mem_open, bin,
+                            bfd_mem_pread, bfd_mem_close, bfd_mem_stat);
+  } else {
+    bfd_h = bfd_openr(fname.c_str(), NULL);
+  }
   if(!bfd_h) {
-    fprintf(stderr, "failed to open binary '%s' (%s)\n",
-            fname.c_str(), bfd_errmsg(bfd_get_error()));
+    load_error("failed to open binary '%s' (%s)\n",
+               fname.c_str(), bfd_errmsg(bfd_get_error()));
     return NULL;
   }
 
   if(!bfd_check_format(bfd_h, bfd_object)) {
-    fprintf(stderr, "file '%s' does not look like an executable (%s)\n",
-            fname.c_str(), bfd_errmsg(bfd_get_error()));
+    load_error("file '%s' does not look like an executable (%s)\n",
+               fname.c_str(), bfd_errmsg(bfd_get_error()));
+    bfd_close(bfd_h);
     return NULL;
   }
 
@@ -78,8 +3115,9 @@ open_bfd(std::string &fname)
   bfd_set_error(bfd_error_no_error);
 
   if(bfd_get_flavour(bfd_h) == bfd_target_unknown_flavour) {
-    fprintf(stderr, "unrecognized format for binary '%s' (%s)\n",
-            fname.c_str(), bfd_errmsg(bfd_get_error()));
+    load_error("unrecognized format for binary '%s' (%s)\n",
+               fname.c_str(), bfd_errmsg(bfd_get_error()));
+    bfd_close(bfd_h);
     return NULL;
   }
 
@@ -98,29 +3136,35 @@ load_symbols_bfd(bfd *bfd_h, Binary *bin)
 
   n = bfd_get_symtab_upper_bound(bfd_h);
   if(n < 0) {
-    fprintf(stderr, "failed to read symtab (%s)\n",
-            bfd_errmsg(bfd_get_error()));
+    load_error("failed to read symtab (%s)\n",
+               bfd_errmsg(bfd_get_error()));
     goto fail;
   } else if(n) {
     bfd_symtab = (asymbol**)malloc(n);
     if(!bfd_symtab) {
-      fprintf(stderr, "failed to allocate memory for dynsym of size %ld\n", n);
+      load_error("failed to allocate memory for dynsym of size %ld\n", n);
       goto fail;
     }
 
     nsyms = bfd_canonicalize_symtab(bfd_h, bfd_symtab);
     if(nsyms < 0) {
-      fprintf(stderr, "failed to read symtab (%s)\n",
-              bfd_errmsg(bfd_get_error()));
+      load_error("failed to read symtab (%s)\n",
+                 bfd_errmsg(bfd_get_error()));
       goto fail;
     }
 
+    for(n = 0, i = 0; i < nsyms; i++) {
+      if(bfd_symtab[i]->flags & BSF_FUNCTION) n++;
+    }
+    bin->symbols.reserve(bin->symbols.size() + n);
+
     for(i = 0; i < nsyms; i++) {
       if(bfd_symtab[i]->flags & BSF_FUNCTION) {
         bin->symbols.push_back(Symbol());
         sym = &bin->symbols.back();
         sym->type = Symbol::SYM_TYPE_FUNC;
-        sym->name = std::string(bfd_symtab[i]->name);
+        sym->sources = Symbol::SYM_SRC_SYMTAB;
+        sym->name = bin->strings.intern(bfd_symtab[i]->name);
         sym->addr = bfd_asymbol_value(bfd_symtab[i]);
       }
     }
@@ -150,29 +3194,35 @@ load_dynsym_bfd(bfd *bfd_h, Binary *bin)
 
   n = bfd_get_dynamic_symtab_upper_bound(bfd_h);
   if(n < 0) {
-    fprintf(stderr, "failed to read dynsym (%s)\n",
-            bfd_errmsg(bfd_get_error()));
+    load_error("failed to read dynsym (%s)\n",
+               bfd_errmsg(bfd_get_error()));
     goto fail;
   } else if(n) {
     bfd_dynsym = (asymbol**)malloc(n);
     if(!bfd_dynsym) {
-      fprintf(stderr, "failed to allocate memory for dynsym of size %ld\n", n);
+      load_error("failed to allocate memory for dynsym of size %ld\n", n);
       goto fail;
     }
 
     nsyms = bfd_canonicalize_dynamic_symtab(bfd_h, bfd_dynsym);
     if(nsyms < 0) {
-      fprintf(stderr, "failed to read dynsym (%s)\n",
-              bfd_errmsg(bfd_get_error()));
+      load_error("failed to read dynsym (%s)\n",
+                 bfd_errmsg(bfd_get_error()));
       goto fail;
     }
 
+    for(n = 0, i = 0; i < nsyms; i++) {
+      if(bfd_dynsym[i]->flags & BSF_FUNCTION) n++;
+    }
+    bin->symbols.reserve(bin->symbols.size() + n);
+
     for(i = 0; i < nsyms; i++) {
       if(bfd_dynsym[i]->flags & BSF_FUNCTION) {
         bin->symbols.push_back(Symbol());
         sym = &bin->symbols.back();
         sym->type = Symbol::SYM_TYPE_FUNC;
-        sym->name = std::string(bfd_dynsym[i]->name);
+        sym->sources = Symbol::SYM_SRC_DYNSYM;
+        sym->name = bin->strings.intern(bfd_dynsym[i]->name);
         sym->addr = bfd_asymbol_value(bfd_dynsym[i]);
       }
     }
@@ -194,19 +3244,28 @@ static int
 load_sections_bfd(bfd *bfd_h, Binary *bin)
 {
   int bfd_flags;
+  bool zero_fill;
   uint64_t vma, size;
   const char *secname;
+  uint8_t *buf;
   asection *bfd_sec;
   Section *sec;
   Section::SectionType sectype;
+  std::vector<uint8_t> tmp;
 
+  bin->sections.reserve(bin->sections.size() + bfd_count_sections(bfd_h));
   for(bfd_sec = bfd_h->sections; bfd_sec; bfd_sec = bfd_sec->next) {
     bfd_flags = bfd_get_section_flags(bfd_h, bfd_sec);
 
+    /* .bss and friends: allocated, but with nothing to read. Thread-local
+     * ones are templates rather than part of the address map. */
+    zero_fill = (bfd_flags & SEC_ALLOC) && !(bfd_flags & SEC_HAS_CONTENTS)
+                && !(bfd_flags & SEC_THREAD_LOCAL);
+
     sectype = Section::SEC_TYPE_NONE;
     if(bfd_flags & SEC_CODE) {
       sectype = Section::SEC_TYPE_CODE;
-    } else if(bfd_flags & SEC_DATA) {
+    } else if((bfd_flags & SEC_DATA) || zero_fill) {
       sectype = Section::SEC_TYPE_DATA;
     } else {
       continue;
@@ -221,33 +3280,61 @@ load_sections_bfd(bfd *bfd_h, Binary *bin)
     sec = &bin->sections.back();
 
     sec->binary = bin;
-    sec->name = std::string(secname);
+    sec->name = bin->strings.intern(secname);
     sec->type = sectype;
     sec->vma = vma;
     sec->size = size;
-    sec->bytes = (uint8_t*)malloc(size);
-    if(!sec->bytes) {
-      fprintf(stderr, "failed to allocate memory for section '%s' of size %ju\n",
-              secname, size);
+    sec->zero_fill = zero_fill;
+    if(zero_fill) {
+      continue; // Section::get_bytes() hands out zeros
+    }
+
+    /* Sections stored verbatim in the file can be deferred or aliased;
+     * anything else (e.g. no file contents) is read through BFD. */
+    if((bfd_flags & SEC_HAS_CONTENTS) && (bfd_sec->filepos >= 0)) {
+      sec->offset = bfd_sec->filepos;
+      if(bin->load_flags & Binary::LOAD_F_LAZY) {
+        continue;
+      }
+      if((bin->load_flags & Binary::LOAD_F_MMAP) && map_section_bytes(sec) == 0) {
+        continue;
+      }
+    }
+
+    /* The section store only takes complete contents */
+    if(bin->load_flags & Binary::LOAD_F_DEDUP) {
+      tmp.resize(size);
+      buf = tmp.data();
+    } else {
+      buf = (uint8_t*)bin->arena.alloc(size);
+    }
+    if(!buf && size) {
+      load_error("failed to allocate memory for section '%s' of size %ju\n",
+                 secname, size);
       goto fail;
     }
 
-    if(!bfd_get_section_contents(bfd_h, bfd_sec, sec->bytes, 0, size)) {
-      fprintf(stderr, "failed to read section '%s' (%s)\n",
-              secname, bfd_errmsg(bfd_get_error()));
+    if(!bfd_get_section_contents(bfd_h, bfd_sec, buf, 0, size)) {
+      load_error("failed to read section '%s' (%s)\n",
+                 secname, bfd_errmsg(bfd_get_error()));
       goto fail;
     }
+
+    if(bin->load_flags & Binary::LOAD_F_DEDUP) {
+      buf = dedup_bytes(bin, buf, size);
+      if(!buf) {
+        load_error("failed to allocate memory for section '%s' of size %ju\n",
+                   secname, size);
+        goto fail;
+      }
+    }
+    sec->bytes = buf;
   }
 
   return 0;
 
 fail:
-  for(auto &sec : bin->sections) {
-    if(sec.bytes) {
-      free(sec.bytes);
-      sec.bytes = NULL;
-    }
-  }
+  free_section_bytes(bin);
 
   return -1;
 }
@@ -255,12 +3342,16 @@ fail:
 static int
 load_binary_bfd(std::string &fname, Binary *bin, Binary::BinaryType type)
 {
+  /* BFD keeps global state (the error code, its open file cache, ...), so
+   * only one thread may be inside it at a time. Holding the lock for the
+   * whole load also keeps the error code private to this call. */
+  std::lock_guard<std::mutex> bfd_guard(bfd_lock);
   int ret;
   bfd *bfd_h;
   const bfd_arch_info_type *bfd_info;
 
   bfd_h = NULL;
-  bfd_h = open_bfd(fname);
+  bfd_h = open_bfd(fname, bin);
   if(!bfd_h) {
     goto fail;
   }
@@ -278,7 +3369,7 @@ load_binary_bfd(std::string &fname, Binary *bin, Binary::BinaryType type)
     break;
   case bfd_target_unknown_flavour:
   default:
-    fprintf(stderr, "unsupported binary type (%s)\n", bfd_h->xvec->name);
+    load_error("unsupported binary type (%s)\n", bfd_h->xvec->name);
     goto fail;
   }
 
@@ -294,16 +3385,21 @@ load_binary_bfd(std::string &fname, Binary *bin, Binary::BinaryType type)
     bin->bits = 64;
     break;
   default:
-    fprintf(stderr, "unsupported architecture (%s)\n",
-            bfd_info->printable_name);
+    load_error("unsupported architecture (%s)\n",
+               bfd_info->printable_name);
     goto fail;
   }
 
   /* Symbol handling is best-effort only (they may not even be present) */
-  load_symbols_bfd(bfd_h, bin);
-  load_dynsym_bfd(bfd_h, bin);
+  if(!(bin->load_flags & Binary::LOAD_F_NO_SYMTAB)) {
+    load_symbols_bfd(bfd_h, bin);
+  }
+  if(!(bin->load_flags & Binary::LOAD_F_NO_DYNSYM)) {
+    load_dynsym_bfd(bfd_h, bin);
+  }
 
-  if(load_sections_bfd(bfd_h, bin) < 0) goto fail;
+  if(!(bin->load_flags & Binary::LOAD_F_NO_SECTIONS)
+     && load_sections_bfd(bfd_h, bin) < 0) goto fail;
 
   ret = 0;
   goto cleanup;
@@ -317,6 +3413,84 @@ cleanup:
   return ret;
 }
 
+/* Fills in the bytes of the sections and segments the native parsers
+ * described, unless they are left for Section/Segment::get_bytes() */
+static int
+load_sections_native(Binary *bin)
+{
+  for(auto &sec : bin->sections) {
+    if(bin->load_flags & Binary::LOAD_F_LAZY) {
+      break;
+    } else if(sec.zero_fill) {
+      continue; // Nothing in the file, get_bytes() hands out zeros
+    } else if(sec.compress) {
+      /* Inflated on first get_bytes(), unless the caller's buffer (and
+       * with it the compressed stream) is gone by then */
+      if(bin->map_external && !(bin->load_flags & Binary::LOAD_F_MMAP)
+         && sec.size && inflate_section_bytes(&sec) < 0) {
+        return -1;
+      }
+    } else if(bin->load_flags & Binary::LOAD_F_MMAP) {
+      if(map_section_bytes(&sec) < 0) return -1;
+    } else {
+      sec.bytes = copy_bytes(bin, bin->map + sec.offset, sec.size);
+      if(!sec.bytes) {
+        load_error("failed to allocate memory for section '%s' of size %ju\n",
+                   sec.name.c_str(), sec.size);
+        return -1;
+      }
+    }
+  }
+
+  for(auto &seg : bin->segments) {
+    if(bin->load_flags & Binary::LOAD_F_LAZY) {
+      break;
+    } else if(bin->load_flags & Binary::LOAD_F_MMAP) {
+      if(map_segment_bytes(&seg) < 0) return -1;
+    } else {
+      seg.bytes = copy_bytes(bin, bin->map + seg.offset, seg.file_size);
+      if(!seg.bytes) {
+        load_error("failed to allocate memory for segment at 0x%016jx of size %ju\n",
+                   seg.vma, seg.file_size);
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static int
+load_binary_native(std::string &fname, Binary *bin,
+                   int (*parse)(const uint8_t*, size_t, Binary*))
+{
+  int ret;
+  bool tmpmap;
+
+  /* The native parsers always work from a mapping; without LOAD_F_MMAP
+   * it is only kept for the duration of the parse. */
+  tmpmap = !bin->map;
+  if(tmpmap && map_binary(fname, bin) < 0) {
+    return -1;
+  }
+
+  bin->filename = std::string(fname);
+
+  ret = parse(bin->map, bin->map_size, bin);
+  if(ret == 0) {
+    ret = load_sections_native(bin);
+  }
+  if(ret < 0) {
+    free_section_bytes(bin);
+  }
+
+  if(tmpmap) {
+    unmap_binary(bin);
+  }
+
+  return ret;
+}
+
 static int
 load_binary_lem(std::string &fname, Binary *bin)
 {
@@ -350,16 +3524,23 @@ load_binary_lem(std::string &fname, Binary *bin)
     break;
   case unsupported:
   default:
-    fprintf(stderr, "unsupported architecture (%d)\n",
-            obj.arch);
+    load_error("unsupported architecture (%d)\n",
+               obj.arch);
     goto fail;
   }
 
   /* Symbol handling is best-effort only (they may not even be present) */
-  load_symbols_lem(obj, bin);
-  load_dynsym_lem(obj, bin);
+  if(!(bin->load_flags & Binary::LOAD_F_NO_SYMTAB)) {
+    load_symbols_lem(obj, bin);
+  }
+  if(!(bin->load_flags & Binary::LOAD_F_NO_DYNSYM)) {
+    load_dynsym_lem(obj, bin);
+  }
 
-  if(load_sections_lem(obj, bin) < 0) goto fail;
+  if((bin->load_flags & Binary::LOAD_F_SEGMENTS)
+     && load_segments_lem(obj, bin) < 0) goto fail;
+  if(!(bin->load_flags & Binary::LOAD_F_NO_SECTIONS)
+     && load_sections_lem(obj, bin) < 0) goto fail;
 
   ret = 0;
   goto cleanup;
@@ -386,12 +3567,13 @@ load_symbols_lem(elfobj_t &obj, Binary *bin)
   elf_symtab_iterator_init(&obj, &symtab_iter);
   while(elf_symtab_iterator_next(&symtab_iter, &symbol) == ELF_ITER_OK) {
     if(symbol.type == STT_FUNC) {
-      Symbol s = Symbol();
+      bin->symbols.push_back(Symbol());
+      Symbol &s = bin->symbols.back();
       s.type = Symbol::SYM_TYPE_FUNC;
-      s.name = symbol.name;
+      s.sources = Symbol::SYM_SRC_SYMTAB;
+      s.name = bin->strings.intern(symbol.name ? symbol.name : "");
       s.addr = symbol.value;
-
-      bin->symbols.push_back(s);
+      s.size = symbol.size;
     }
   }
 
@@ -411,12 +3593,13 @@ load_dynsym_lem(elfobj_t &obj, Binary *bin)
   elf_dynsym_iterator_init(&obj, &dynsym_iter);
   while(elf_dynsym_iterator_next(&dynsym_iter, &symbol) == ELF_ITER_OK) {
     if(symbol.type == STT_FUNC) {
-      Symbol s = Symbol();
+      bin->symbols.push_back(Symbol());
+      Symbol &s = bin->symbols.back();
       s.type = Symbol::SYM_TYPE_FUNC;
-      s.name = symbol.name;
+      s.sources = Symbol::SYM_SRC_DYNSYM;
+      s.name = bin->strings.intern(symbol.name ? symbol.name : "");
       s.addr = symbol.value;
-
-      bin->symbols.push_back(s);
+      s.size = symbol.size;
     }
   }
 
@@ -435,8 +3618,8 @@ load_sections_lem(elfobj_t &obj, Binary *bin)
 
   elf_section_iterator_init(&obj, &section_iter);
   while(elf_section_iterator_next(&section_iter, &section) == ELF_ITER_OK) {
-    if(section.type == SHT_NOBITS) {
-      continue; // Nothing to load, skip it
+    if(section.type == SHT_NOBITS && (section.flags & SHF_TLS)) {
+      continue; // A per-thread template, not part of the address map
     }
 
     Section::SectionType type;
@@ -444,39 +3627,114 @@ load_sections_lem(elfobj_t &obj, Binary *bin)
       type = Section::SEC_TYPE_CODE;
     } else if(section.flags & SHF_ALLOC) {
       type = Section::SEC_TYPE_DATA;
+    } else if((bin->load_flags & Binary::LOAD_F_NONALLOC) && section.type == SHT_PROGBITS) {
+      type = Section::SEC_TYPE_NONE; // .debug_* and the like, no address
     } else {
       continue; // We only care about code and data sections
     }
 
-    Section s = Section();
+    bin->sections.push_back(Section());
+    Section &s = bin->sections.back();
     s.binary = bin;
     s.type = type;
-    s.name = std::string(section.name ? section.name : "<unnamed>");
+    s.name = bin->strings.intern(section.name ? section.name : "<unnamed>");
     s.vma = section.address;
     s.size = section.size;
-    s.bytes = (uint8_t *)malloc(s.size);
-    if(!s.bytes) {
-      fprintf(stderr, "failed to allocate memory for section '%s' of size %ju\n",
-              s.name.c_str(), s.size);
-      goto fail;
+    s.offset = section.offset;
+    s.zero_fill = (section.type == SHT_NOBITS);
+
+    if(s.zero_fill) {
+      s.offset = 0; // Nothing in the file, Section::get_bytes() hands out zeros
+    } else if(section.flags & SHF_COMPRESSED) {
+      // Leave inflating for the first Section::get_bytes() call
+      const uint8_t *hdr = (uint8_t *)elf_section_pointer(&obj, &section);
+      if(!hdr || s.offset > obj.size || s.size > obj.size - s.offset) {
+        load_error("compressed section '%s' extends past the end of the file\n",
+                   s.name.c_str());
+        goto fail;
+      }
+      if(read_compression_header(bin, &s, hdr) < 0) {
+        goto fail;
+      }
+    } else if(bin->load_flags & Binary::LOAD_F_LAZY) {
+      // Leave the contents for the first Section::get_bytes() call
+    } else if(bin->load_flags & Binary::LOAD_F_MMAP) {
+      // Point straight into our own read-only mapping of the file
+      if(map_section_bytes(&s) < 0) {
+        goto fail;
+      }
+    } else {
+      // Copy the section data out of libelfmaster's mapping
+      const uint8_t *data = (uint8_t *)elf_section_pointer(&obj, &section);
+      s.bytes = copy_bytes(bin, data, s.size);
+      if(!s.bytes) {
+        load_error("failed to allocate memory for section '%s' of size %ju\n",
+                   s.name.c_str(), s.size);
+        goto fail;
+      }
     }
-
-    // Copy the section data into the malloc'd buffer from above
-    const uint8_t *data = (uint8_t *)elf_section_pointer(&obj, &section);
-    memcpy(s.bytes, data, s.size);
-
-    bin->sections.push_back(s);
   }
 
   return 0;
 
 fail:
-  for(auto &sec : bin->sections) {
-    if(sec.bytes) {
-      free(sec.bytes);
-      sec.bytes = NULL;
+  free_section_bytes(bin);
+
+  return -1;
+}
+
+static int
+load_segments_lem(elfobj_t &obj, Binary *bin)
+{
+  elf_segment_iterator_t segment_iter;
+  struct elf_segment segment;
+
+  if(!(obj.flags & ELF_PHDRS_F)) {
+    return 0;
+  }
+
+  elf_segment_iterator_init(&obj, &segment_iter);
+  while(elf_segment_iterator_next(&segment_iter, &segment) == ELF_ITER_OK) {
+    if(segment.type != PT_LOAD) {
+      continue;
+    }
+
+    bin->segments.push_back(Segment());
+    Segment &s = bin->segments.back();
+    s.binary = bin;
+    s.perms = segment.flags & (PF_R | PF_W | PF_X);
+    s.vma = segment.vaddr;
+    s.size = segment.memsz;
+    s.file_size = std::min(segment.filesz, segment.memsz);
+    s.offset = segment.offset;
+
+    if(s.offset > obj.size || s.file_size > obj.size - s.offset) {
+      load_error("segment at 0x%016jx extends past the end of the file\n",
+                 s.vma);
+      goto fail;
+    }
+
+    if(bin->load_flags & Binary::LOAD_F_LAZY) {
+      // Leave the contents for the first Segment::get_bytes() call
+    } else if(bin->load_flags & Binary::LOAD_F_MMAP) {
+      if(map_segment_bytes(&s) < 0) {
+        goto fail;
+      }
+    } else {
+      // The zero-filled tail (memsz past filesz) is never allocated
+      s.bytes = copy_bytes(bin, obj.mem + s.offset, s.file_size);
+      if(!s.bytes) {
+        load_error("failed to allocate memory for segment at 0x%016jx of size %ju\n",
+                   s.vma, s.file_size);
+        goto fail;
+      }
     }
   }
 
+  return 0;
+
+fail:
+  free_section_bytes(bin);
+
   return -1;
 }
@@ -1,13 +1,138 @@
 #ifndef LOADER_H
 #define LOADER_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#include <functional>
+#include <iterator>
+#include <memory>
 #include <string>
 #include <vector>
 
 class Binary;
 class Section;
+class Segment;
 class Symbol;
+class SectionIndex;
+struct SectionBytes;
+
+/* Read-only view of a NUL-terminated string, normally one owned by a
+ * Binary's StringArena or snapshot. It offers the parts of the
+ * std::string interface that callers use on Symbol::name and
+ * Section::name, and stays valid for as long as the Binary it came
+ * from. */
+class StrRef {
+public:
+  StrRef() : str(""), len(0) {}
+  StrRef(const char *s) : str(s), len(strlen(s)) {}
+  StrRef(const char *s, size_t n) : str(s), len(n) {}
+
+  const char *c_str() const { return str; }
+  const char *data() const { return str; }
+  size_t size() const { return len; }
+  size_t length() const { return len; }
+  bool empty() const { return len == 0; }
+  char operator[](size_t i) const { return str[i]; }
+  operator std::string() const { return std::string(str, len); }
+
+  bool operator==(const StrRef &o) const
+    { return (len == o.len) && (str == o.str || !memcmp(str, o.str, len)); }
+  bool operator!=(const StrRef &o) const { return !(*this == o); }
+  bool operator==(const char *o) const { return *this == StrRef(o); }
+  bool operator!=(const char *o) const { return !(*this == o); }
+  bool operator==(const std::string &o) const { return *this == StrRef(o.c_str(), o.size()); }
+  bool operator!=(const std::string &o) const { return !(*this == o); }
+
+private:
+  const char *str;
+  size_t      len;
+};
+
+/* Where an Arena gets its blocks from. Callers that keep their own memory
+ * pool can point Binary::set_allocator() at it; by default blocks come
+ * from malloc() and go back with free(). */
+struct ArenaAllocator {
+  void *(*alloc)(size_t size, void *ctx);
+  void  (*free)(void *p, size_t size, void *ctx);
+  void   *ctx;
+};
+
+/* Region allocator: hands out memory from large blocks by bumping a
+ * pointer, and gives it all back at once in reset(). Individual
+ * allocations are never freed. */
+class Arena {
+public:
+  Arena() : cur(NULL), cur_used(0), cur_size(0), nbytes(0), allocator() {}
+  ~Arena() { reset(); }
+
+  Arena(Arena &&o);
+  Arena& operator=(Arena &&o);
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  /* Releases everything and takes further blocks from a (NULL: malloc) */
+  void set_allocator(const ArenaAllocator *a);
+
+  void *alloc(size_t n, size_t align = 16);
+  void reset();
+
+  size_t bytes() const { return nbytes; }  /* memory held in blocks */
+
+private:
+  struct Block {
+    char   *p;
+    size_t  size;
+  };
+
+  char *new_block(size_t size);
+
+  std::vector<Block>  blocks;
+  char               *cur;
+  size_t              cur_used;
+  size_t              cur_size;
+  size_t              nbytes;
+  ArenaAllocator      allocator;  /* alloc is NULL for malloc/free */
+};
+
+/* Per-Binary string storage. Every distinct string is stored once in an
+ * Arena and handed out as a StrRef; so a name that appears in both the
+ * static and the dynamic symbol table costs one copy and no allocation
+ * of its own. */
+class StringArena {
+public:
+  StringArena() : count(0) {}
+
+  StringArena(StringArena &&o);
+  StringArena& operator=(StringArena &&o);
+  StringArena(const StringArena&) = delete;
+  StringArena& operator=(const StringArena&) = delete;
+
+  void set_allocator(const ArenaAllocator *a) { clear(); mem.set_allocator(a); }
+
+  StrRef intern(const char *s, size_t len);
+  StrRef intern(const char *s) { return intern(s, strlen(s)); }
+  void reserve(size_t n);  /* room for n distinct strings without rehashing */
+  void clear();
+
+  size_t size() const { return count; }    /* distinct strings */
+  size_t bytes() const                     /* memory held, including the table */
+    { return mem.bytes() + table.size()*sizeof(table[0]); }
+
+private:
+  /* Stored in mem right before each string, so that a table slot only
+   * needs a pointer to the string */
+  struct Header {
+    uint32_t hash;
+    uint32_t len;
+  };
+
+  static const Header *header(const char *s) { return (const Header*)s - 1; }
+
+  Arena                     mem;
+  std::vector<const char*>  table;  /* open addressing, NULL if free */
+  size_t                    count;
+};
 
 class Symbol {
 public:
@@ -16,32 +141,304 @@ public:
     SYM_TYPE_FUNC = 1
   };
 
-  Symbol() : type(SYM_TYPE_UKN), name(), addr(0) {}
+  enum SymbolSource {
+    SYM_SRC_SYMTAB = (1 << 0), /* static symbol table (PE: COFF symbols) */
+    SYM_SRC_DYNSYM = (1 << 1)  /* dynamic symbol table (PE: exports) */
+  };
+
+  Symbol() : type(SYM_TYPE_UKN), sources(0), name(), addr(0), size(0) {}
 
   SymbolType  type;
-  std::string name;
+  uint8_t     sources;  /* SymbolSource bits of every table listing it */
+  StrRef      name;     /* owned by the Binary's string arena or snapshot */
   uint64_t    addr;
+  uint64_t    size;  /* 0 if the symbol table does not say */
+};
+
+/* Column-wise copy of Binary::symbols for passes that scan many symbols
+ * but only look at a field or two. Each field has its own contiguous
+ * array, so e.g. a sweep over addresses streams 8 bytes per symbol rather
+ * than a whole Symbol. Built by load_binary() under LOAD_F_SYMBOL_COLUMNS.
+ * The iterators reassemble Symbols, so read-only range-for loops written
+ * against Binary::symbols (for(auto &s : ...), it->addr) work on the
+ * columns too. operator[] returns a copy, though, so code that takes
+ * &symbols[i] or writes to the symbols has to stay on Binary::symbols. */
+class SymbolColumns {
+public:
+  class const_iterator {
+  public:
+    typedef std::input_iterator_tag iterator_category;
+    typedef Symbol                  value_type;
+    typedef ptrdiff_t               difference_type;
+    typedef const Symbol*           pointer;
+    typedef const Symbol&           reference;
+
+    const_iterator(const SymbolColumns *cols, size_t i) : cols(cols), i(i) {}
+
+    /* The Symbol is assembled inside the iterator; references to it stay
+     * valid until the iterator moves on */
+    const Symbol& operator*() const { cur = (*cols)[i]; return cur; }
+    const Symbol* operator->() const { return &**this; }
+    const_iterator& operator++() { i++; return *this; }
+    const_iterator operator++(int) { const_iterator t(*this); i++; return t; }
+    bool operator==(const const_iterator &o) const { return i == o.i; }
+    bool operator!=(const const_iterator &o) const { return i != o.i; }
+
+  private:
+    const SymbolColumns *cols;
+    size_t               i;
+    mutable Symbol       cur;
+  };
+
+  void build(const std::vector<Symbol> &symbols);
+  void clear();
+
+  size_t size() const { return addrs.size(); }
+  bool empty() const { return addrs.empty(); }
+  size_t bytes() const  /* memory held */
+    { return addrs.capacity()*sizeof(uint64_t) + sizes.capacity()*sizeof(uint64_t)
+             + types.capacity() + sources.capacity() + names.capacity()*sizeof(StrRef); }
+
+  Symbol operator[](size_t i) const
+    { Symbol s; s.type = (Symbol::SymbolType)types[i]; s.sources = sources[i];
+      s.name = names[i]; s.addr = addrs[i]; s.size = sizes[i]; return s; }
+
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, size()); }
+
+  std::vector<uint64_t> addrs;
+  std::vector<uint64_t> sizes;
+  std::vector<uint8_t>  types;    /* Symbol::SymbolType */
+  std::vector<uint8_t>  sources;  /* Symbol::SymbolSource bits */
+  std::vector<StrRef>   names;    /* owned by the Binary's string arena */
+};
+
+/* Address-to-symbol index over Binary::symbols, built by load_binary().
+ * The sorted start addresses are stored in Eytzinger (BFS) order, so a
+ * lookup walks down the array with a branch-free loop whose next probes
+ * can be prefetched, instead of hopping around a sorted array. */
+class SymbolAddrIndex {
+public:
+  /* sections is the Binary's (built) sec_index; it bounds the extent of
+   * symbols whose size is unknown */
+  void build(std::vector<Symbol> &symbols, const SectionIndex &sections);
+
+  /* Returns the index of the symbol containing addr, i.e. the one with the
+   * highest start address <= addr and addr within its size, or -1 if there
+   * is none. A symbol of unknown size extends to the next symbol's address
+   * or, for the last one, to the end of its section. */
+  long lookup(uint64_t addr) const
+    { size_t k, n = keys.size() - 1;
+      if(keys.empty()) return -1;
+      for(k = 1; k <= n; k = 2*k + (keys[k] <= addr)) {
+        __builtin_prefetch(keys.data() + 16*k);  /* 4 levels down */
+      }
+      k >>= __builtin_ffsll(~k);  /* first start address > addr, or 0 */
+      return (addr < pred[k].end) ? pred[k].sym : -1; }
+
+  size_t bytes() const  /* memory held */
+    { return keys.capacity()*sizeof(uint64_t) + pred.capacity()*sizeof(Pred); }
+
+private:
+  friend struct SnapshotCodec;
+
+  /* The symbol preceding keys[k] in address order (pred[0]: the last one),
+   * with its end address so that lookups need not touch Binary::symbols */
+  struct Pred {
+    uint64_t end;
+    long     sym;
+  };
+
+  std::vector<uint64_t> keys;  /* start addresses, 1-based Eytzinger order */
+  std::vector<Pred>     pred;
+};
+
+/* Name-to-symbol index over Binary::symbols, built by load_binary(). An
+ * open-addressing table holding each distinct name once, keyed by its GNU
+ * ELF hash; hash values already present in the binary's .gnu.hash section
+ * are reused instead of being recomputed. */
+class SymbolNameIndex {
+public:
+  void build(std::vector<Symbol> &symbols);
+
+  /* Returns the index of the first symbol called name, or -1 */
+  long lookup(std::vector<Symbol> &symbols, StrRef name) const;
+
+  /* Records a known GNU hash for symbols[sym], for use by the next build() */
+  void set_hash(size_t sym, uint32_t hash)
+    { if(hints.size() <= sym) hints.resize(sym + 1, 0); hints[sym] = hash | 1; }
+
+  /* Carries the recorded hashes over when the symbol table is reordered
+   * or merged: symbol j has become symbol to[j] of nsyms */
+  void remap_hints(const std::vector<uint32_t> &to, size_t nsyms);
+
+  size_t bytes() const  /* memory held */
+    { return slots.capacity()*sizeof(Slot) + hints.capacity()*sizeof(uint32_t); }
+
+private:
+  friend struct SnapshotCodec;
+
+  struct Slot {
+    uint32_t hash;
+    long     sym;   /* -1 if the slot is free */
+  };
+
+  std::vector<Slot>     slots;  /* power-of-two sized, at most half full */
+  std::vector<uint32_t> hints;  /* hash | 1 where known, 0 otherwise */
 };
 
 class Section {
 public:
   enum SectionType {
-    SEC_TYPE_NONE = 0,
+    SEC_TYPE_NONE = 0,  /* not allocated (LOAD_F_NONALLOC), has no address */
     SEC_TYPE_CODE = 1,
     SEC_TYPE_DATA = 2
   };
 
   Section() : binary(NULL), type(SEC_TYPE_NONE),
-              vma(0), size(0), bytes(NULL) {}
+              vma(0), size(0), offset(0), zero_fill(false),
+              compress(0), raw_size(0), bytes(NULL) {}
+
+  /* Sections belong to exactly one Binary, whose arena holds the bytes
+   * (or which holds a reference to them, under LOAD_F_DEDUP) */
+  Section(Section&&) = default;
+  Section& operator=(Section&&) = default;
+  Section(const Section&) = delete;
+  Section& operator=(const Section&) = delete;
 
   bool contains(uint64_t addr) { return (addr >= vma) && (addr - vma < size); }
 
+  /* Returns the section contents, reading them in on first use if the
+   * binary was loaded with LOAD_F_LAZY. Returns NULL on read failure.
+   * Zero-fill sections get read-only zeros that take no memory of their
+   * own: a shared static block, or an anonymous mapping if they are big.
+   * Compressed sections are inflated here, on first use, whatever the
+   * load flags; see decompress_sections() to do many at once. */
+  uint8_t *get_bytes();
+
   Binary       *binary;
-  std::string   name;
+  StrRef        name;    /* owned by the Binary's string arena or snapshot */
   SectionType   type;
   uint64_t      vma;
-  uint64_t      size;
-  uint8_t      *bytes;
+  uint64_t      size;       /* of the contents, once inflated if compressed */
+  uint64_t      offset;     /* file offset of the contents (compressed: of
+                             * the stream after the ELF compression header) */
+  bool          zero_fill;  /* .bss and the like: no contents in the file */
+  uint32_t      compress;   /* ELFCOMPRESS_* for SHF_COMPRESSED, else 0 */
+  uint64_t      raw_size;   /* compressed: length of the stream in the file */
+  uint8_t      *bytes;      /* NULL until first get_bytes() under LOAD_F_LAZY,
+                             * and for zero-fill and compressed sections */
+};
+
+/* A loadable segment (ELF PT_LOAD), loaded under LOAD_F_SEGMENTS. Only
+ * [vma, vma + file_size) has bytes behind it; the rest, up to vma + size,
+ * is zero-fill that read_vaddr() serves without allocating anything. */
+class Segment {
+public:
+  enum SegmentPerms {
+    SEG_PERM_X = (1 << 0), /* same values as the ELF PF_* flags */
+    SEG_PERM_W = (1 << 1),
+    SEG_PERM_R = (1 << 2)
+  };
+
+  Segment() : binary(NULL), perms(0), vma(0), size(0), file_size(0),
+              offset(0), bytes(NULL) {}
+
+  Segment(Segment&&) = default;
+  Segment& operator=(Segment&&) = default;
+  Segment(const Segment&) = delete;
+  Segment& operator=(const Segment&) = delete;
+
+  bool contains(uint64_t addr) { return (addr >= vma) && (addr - vma < size); }
+
+  /* Returns the file-backed part of the segment, file_size bytes; loaded
+   * like Section::get_bytes() */
+  uint8_t *get_bytes();
+
+  Binary       *binary;
+  unsigned      perms;      /* SegmentPerms */
+  uint64_t      vma;
+  uint64_t      size;       /* in memory */
+  uint64_t      file_size;  /* in the file, at most size */
+  uint64_t      offset;     /* file offset of the contents */
+  uint8_t      *bytes;      /* NULL until first get_bytes() under LOAD_F_LAZY */
+};
+
+/* Address-to-section map over Binary::sections, built by load_binary().
+ * The sections are flattened into sorted, disjoint address ranges (where
+ * they overlap, the first in Binary::sections wins, as it would in a
+ * linear scan). A table indexed by page number gives the first range that
+ * can hold an address on that page, so a lookup is a shift, a load and
+ * usually one or two compares. It also remembers where the well-known
+ * sections are. Binary::segments get an index of their own, built the
+ * same way. */
+class SectionIndex {
+public:
+  enum SectionId {
+    SEC_ID_TEXT     = 0,
+    SEC_ID_DATA     = 1,
+    SEC_ID_RODATA   = 2, /* .rodata, or .rdata in PE files */
+    SEC_ID_PLT      = 3,
+    SEC_ID_GOT      = 4,
+    SEC_ID_INIT     = 5,
+    SEC_ID_FINI     = 6,
+    SEC_ID_EH_FRAME = 7,
+    SEC_ID_BSS      = 8,
+    SEC_ID_MAX
+  };
+
+  SectionIndex() : base(0), span(0), shift(0)
+    { for(unsigned i = 0; i < SEC_ID_MAX; i++) ids[i] = -1; }
+
+  void build(std::vector<Section> &sections);
+  void build(std::vector<Segment> &segments);
+
+  /* Returns the index of the section containing addr, or -1 */
+  long lookup(uint64_t addr) const
+    { size_t i;
+      if(addr - base >= span) return -1;
+      for(i = pages[(addr - base) >> shift]; ranges[i].end <= addr; i++);
+      return (ranges[i].start <= addr) ? ranges[i].sec : -1; }
+
+  /* As above, also returning the extent [*start, *end) around addr over
+   * which the answer stays the same */
+  long lookup(uint64_t addr, uint64_t *start, uint64_t *end) const
+    { size_t i;
+      if(addr - base >= span) return -1;
+      for(i = pages[(addr - base) >> shift]; ranges[i].end <= addr; i++);
+      if(ranges[i].start > addr) return -1;
+      *start = ranges[i].start; *end = ranges[i].end; return ranges[i].sec; }
+
+  /* For an addr that lookup() finds in no section, narrows [*start, *end)
+   * around it to the gap between the sections on either side */
+  void clip_to_gap(uint64_t addr, uint64_t *start, uint64_t *end) const;
+
+  /* Returns the index of the first section of the given kind, or -1 */
+  long find(SectionId id) const { return ids[id]; }
+
+  /* False until build() has run, e.g. for sections filled in by hand */
+  bool built() const { return !ranges.empty(); }
+
+  size_t bytes() const  /* memory held */
+    { return ranges.capacity()*sizeof(Range) + pages.capacity()*sizeof(uint32_t); }
+
+private:
+  friend struct SnapshotCodec;
+
+  void build_ranges(const std::vector<std::pair<uint64_t, uint64_t> > &extents);
+
+  struct Range {
+    uint64_t start;
+    uint64_t end;
+    long     sec;
+  };
+
+  std::vector<Range>    ranges;  /* by address, ending in a catch-all sentinel */
+  std::vector<uint32_t> pages;   /* first range ending past each page start */
+  uint64_t              base;
+  uint64_t              span;    /* base + span: end of the last section */
+  unsigned              shift;   /* log2 of the page size */
+  long                  ids[SEC_ID_MAX];
 };
 
 class Binary {
@@ -57,10 +454,81 @@ public:
     ARCH_X86  = 1
   };
 
-  Binary() : type(BIN_TYPE_AUTO), arch(ARCH_NONE), bits(0), entry(0) {}
+  enum LoadFlags {
+    LOAD_F_DEFAULT      = 0,
+    LOAD_F_MMAP         = (1 << 0), /* Section::bytes alias a read-only file mapping */
+    LOAD_F_LAZY         = (1 << 1), /* section contents are read on first get_bytes() */
+    LOAD_F_NATIVE       = (1 << 2), /* parse ELF with the built-in parser, not libelfmaster */
+    LOAD_F_ALIAS        = (1 << 3), /* load_binary_from_memory: Section::bytes alias the buffer */
+
+    /* Partial loads: skip the tables that are not needed. Section bytes
+     * can be left out separately with LOAD_F_LAZY. */
+    LOAD_F_NO_SYMTAB    = (1 << 4), /* static symbols (PE: COFF symbols) */
+    LOAD_F_NO_DYNSYM    = (1 << 5), /* dynamic symbols (PE: exports) */
+    LOAD_F_NO_SECTIONS  = (1 << 6),
+    LOAD_F_HEADERS_ONLY = LOAD_F_NO_SYMTAB | LOAD_F_NO_DYNSYM | LOAD_F_NO_SECTIONS,
+
+    LOAD_F_SYMBOL_COLUMNS = (1 << 7), /* also fill in Binary::symcols */
+    LOAD_F_SEGMENTS       = (1 << 8), /* also load ELF PT_LOAD segments */
+    LOAD_F_DEDUP          = (1 << 9), /* copied contents go to the shared section store */
+    LOAD_F_NONALLOC       = (1 << 10), /* ELF: also keep non-allocated PROGBITS sections
+                                        * (.debug_* and the like) */
+    LOAD_F_BFD            = (1 << 11)  /* always go through BFD, e.g. to compare with
+                                        * the native parsers */
+  };
+
+  Binary() : type(BIN_TYPE_AUTO), arch(ARCH_NONE), bits(0), entry(0),
+             load_flags(0), map(NULL), map_size(0), map_external(false),
+             snap(NULL), snap_size(0),
+             vread_start(0), vread_end(0), vread_bytes(NULL) {}
+  ~Binary();
+
+  /* A Binary owns its mapping and arenas and releases them when it goes
+   * away (see unload_binary()); it can be moved but not copied */
+  Binary(Binary &&o);
+  Binary& operator=(Binary &&o);
+  Binary(const Binary&) = delete;
+  Binary& operator=(const Binary&) = delete;
+
+  /* Takes section copies and names from a's pool from now on; only to be
+   * called on a Binary that is not loaded */
+  void set_allocator(const ArenaAllocator *a)
+    { arena.set_allocator(a); strings.set_allocator(a); }
+
+  /* Returns the first section of the given kind. Uses sec_index, as built
+   * by load_binary(); for a Binary whose sections were filled in by hand
+   * (no index yet) it falls back to looking for the section by name. */
+  Section *get_section(SectionIndex::SectionId id);
 
   Section *get_text_section()
-    { for(auto &s : sections) if(s.name == ".text") return &s; return NULL; }
+    { return get_section(SectionIndex::SEC_ID_TEXT); }
+
+  Section *get_section_by_addr(uint64_t addr)
+    { long i = sec_index.lookup(addr); return i < 0 ? NULL : &sections[i]; }
+
+  /* Returns a read-only view of the len bytes at virtual address vaddr,
+   * or NULL if any of them lies outside the loaded sections (and, failing
+   * those, segments). A range within one section is returned in place;
+   * one that straddles sections is gathered into buf if given (len
+   * bytes), else into a buffer of the Binary's own that is only valid
+   * until the next read_vaddr() call. The last section hit is remembered,
+   * so sequential reads skip the lookup. Like Section::get_bytes(), not
+   * safe to call concurrently. */
+  const uint8_t *read_vaddr(uint64_t vaddr, size_t len, uint8_t *buf = NULL)
+    { if(vaddr - vread_start < vread_end - vread_start && len <= vread_end - vaddr)
+        return vread_bytes + (vaddr - vread_start);
+      return read_vaddr_slow(vaddr, len, buf); }
+  const uint8_t *read_vaddr_slow(uint64_t vaddr, size_t len, uint8_t *buf);
+
+  Symbol *get_symbol_by_addr(uint64_t addr)
+    { long i = sym_by_addr.lookup(addr); return i < 0 ? NULL : &symbols[i]; }
+
+  Symbol *get_symbol_by_name(StrRef name)
+    { long i = sym_by_name.lookup(symbols, name); return i < 0 ? NULL : &symbols[i]; }
+  Symbol *get_symbol_by_name(const char *name)
+    { return get_symbol_by_name(StrRef(name)); }
+  Symbol *get_symbol_by_name(const std::string &name)
+    { return get_symbol_by_name(StrRef(name.c_str(), name.size())); }
 
   std::string           filename;
   BinaryType            type;
@@ -70,10 +538,163 @@ public:
   unsigned              bits;
   uint64_t              entry;
   std::vector<Section>  sections;
+  SectionIndex          sec_index;
+  std::vector<Segment>  segments;   /* empty unless LOAD_F_SEGMENTS */
+  SectionIndex          seg_index;
   std::vector<Symbol>   symbols;
+  SymbolColumns         symcols;  /* empty unless LOAD_F_SYMBOL_COLUMNS */
+  std::string           error;    /* why the last load into this Binary failed */
+  Arena                 arena;    /* backs the copied section contents */
+  StringArena           strings;  /* backs all section and symbol names */
+  SymbolAddrIndex       sym_by_addr;
+  SymbolNameIndex       sym_by_name;
+  int                   load_flags;
+
+  /* Set only when loaded with LOAD_F_MMAP, or from memory with
+   * LOAD_F_ALIAS; released by unload_binary */
+  uint8_t              *map;
+  size_t                map_size;
+  bool                  map_external;  /* map is the caller's buffer */
+
+  /* The snapshot (or parse cache entry) the Binary was loaded from, if
+   * any: names, and section contents if it has them, point into it */
+  uint8_t              *snap;
+  size_t                snap_size;
+
+  /* Anonymous read-only mappings backing big zero-fill sections */
+  std::vector<std::pair<uint8_t*, size_t> > zero_maps;
+
+  /* References into the section store, under LOAD_F_DEDUP */
+  std::vector<SectionBytes*> dedup_refs;
+
+  /* read_vaddr() state: the address range resolved last and the bytes
+   * backing it, and the buffer for reads that straddle sections */
+  uint64_t              vread_start;
+  uint64_t              vread_end;
+  const uint8_t        *vread_bytes;
+  std::vector<uint8_t>  vread_buf;
 };
 
-int load_binary(std::string &fname, Binary *bin, Binary::BinaryType type);
+/* Format dispatch counters accumulated over all BIN_TYPE_AUTO loads */
+struct LoaderStats {
+  uint64_t probed_elf;     /* ELF magic, loaded with libelfmaster or natively */
+  uint64_t probed_pe;      /* MZ magic, loaded with the native PE parser */
+  uint64_t probed_other;   /* unknown magic, left for BFD to identify */
+  uint64_t bfd_fallbacks;  /* ELF and PE files the native or libelfmaster backend
+                            * rejected, retried with BFD */
+
+  /* Parse cache counters, over all load_binary() calls while it is on */
+  uint64_t cache_hits;     /* loaded from the cache without parsing */
+  uint64_t cache_misses;   /* no usable entry, parsed as usual */
+  uint64_t cache_stores;   /* entries written after a miss */
+
+  /* Shared binary counters, see get_shared_binary() */
+  uint64_t shared_hits;       /* handed out from the cache */
+  uint64_t shared_misses;     /* loaded */
+  uint64_t shared_coalesced;  /* waited for a load another thread had started */
+  uint64_t shared_evictions;  /* dropped to stay within the budget */
+  uint64_t shared_bytes;      /* held by the cache now (not reset) */
+
+  /* Section store, see LOAD_F_DEDUP; both are current totals, not reset.
+   * dedup_bytes / dedup_stored is the deduplication ratio. */
+  uint64_t dedup_bytes;   /* contents handed out to loaded Binaries */
+  uint64_t dedup_stored;  /* distinct contents actually held */
+};
+
+/* How the parse cache tells whether an entry still matches the file */
+enum ParseCacheKey {
+  PARSE_CACHE_KEY_STAT    = 0, /* device, inode, mtime and size: only a stat() */
+  PARSE_CACHE_KEY_CONTENT = 1  /* a hash of the whole file contents */
+};
+
+/* load_binary() and unload_binary() may be called concurrently from any
+ * number of threads, as long as each call works on its own Binary. Loads
+ * that end up in BFD are serialized internally; libelfmaster and the
+ * native parsers run in parallel. Errors are printed to stderr as they
+ * happen and also collected in bin->error, so each call can tell why it
+ * failed without looking at any shared state. */
+int load_binary(std::string &fname, Binary *bin, Binary::BinaryType type,
+                int flags = Binary::LOAD_F_DEFAULT);
+/* Parses a binary image that is already in memory. Section contents are
+ * copied out unless flags has LOAD_F_ALIAS, in which case Section::bytes
+ * point into buf and the caller must keep it alive (and unmodified) until
+ * unload_binary(). LOAD_F_LAZY is only honoured together with LOAD_F_ALIAS.
+ * ELF images always go through the native parser. */
+int load_binary_from_memory(const uint8_t *buf, size_t size, Binary *bin,
+                            Binary::BinaryType type,
+                            int flags = Binary::LOAD_F_DEFAULT);
+/* Releases everything load_binary() set up: section contents and names
+ * are dropped wholesale with their arenas, and the section and symbol
+ * tables are emptied. */
 void unload_binary(Binary *bin);
 
+/* Batch loading: loads every file in fnames on nthreads workers (0 means
+ * one per CPU) and hands each result to callback as soon as it completes.
+ * Callbacks are never run concurrently. If fname failed to load, bin is
+ * NULL and error says why (what would have been in Binary::error);
+ * otherwise error is empty, and bin is unloaded and freed once the
+ * callback returns. Returns the number of files that failed to load. */
+typedef std::function<void(const std::string &fname, Binary *bin,
+                           const std::string &error)> LoadCallback;
+
+int load_binaries(std::vector<std::string> &fnames, Binary::BinaryType type,
+                  int flags, unsigned nthreads, LoadCallback callback);
+
+/* How the loader and its backends report errors: printf-style, to stderr
+ * and to the Binary::error of the load running on this thread, if any */
+void load_error(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+void get_loader_stats(LoaderStats *stats);
+void reset_loader_stats();
+
+/* Turns on the on-disk parse cache in directory dir (NULL turns it off).
+ * load_binary() then looks each file up there first, and on a hit rebuilds
+ * the Binary's header fields, sections, segments and symbols from the
+ * cache entry without running libelfmaster, BFD or the native parsers;
+ * section contents still come from the file itself. After a miss the
+ * parsed result is written back, as a snapshot without section contents
+ * (see save_snapshot()). Entries are in host byte order and only
+ * meant to be read on the machine that wrote them. Not to be called while
+ * loads are running. Returns -1 if dir is not a directory. */
+int set_parse_cache(const char *dir, ParseCacheKey key = PARSE_CACHE_KEY_STAT);
+
+/* Inflates every compressed section of bin that get_bytes() has not done
+ * yet, on nthreads workers (0 means one per CPU). Only zlib
+ * (ELFCOMPRESS_ZLIB) is supported. Not to be called while other threads
+ * use bin. Returns the number of sections that failed to inflate. */
+int decompress_sections(Binary *bin, unsigned nthreads = 0);
+
+/* Snapshots: a loaded Binary written out as one flat, versioned image
+ * that load_snapshot() maps and uses in place. Names, the lookup indexes
+ * and (with with_bytes) the section and segment contents are all stored,
+ * so loading involves no parsing, hashing or sorting. Without with_bytes
+ * the contents are read from the original file when the snapshot is
+ * loaded (as the load flags say), and that file must not have changed
+ * in the meantime. Like parse cache entries, snapshots are in host byte
+ * order. */
+int save_snapshot(Binary *bin, std::string &fname, bool with_bytes = false);
+int load_snapshot(std::string &fname, Binary *bin,
+                  int flags = Binary::LOAD_F_DEFAULT);
+
+/* Shared binaries: a process-wide cache of loaded Binaries for services
+ * that keep asking for the same files. get_shared_binary() hands out a
+ * handle to the cached Binary for fname, as long as the file's inode and
+ * mtime are unchanged, and loads it otherwise; threads asking for a file
+ * that is being loaded wait for that load rather than start their own.
+ * Returns an empty handle if the load fails.
+ *
+ * The least recently used entries are dropped once the cache holds more
+ * than its byte budget (section contents, mappings, names, symbol tables
+ * and indexes all count). Handles keep their Binary alive after that.
+ * A cached Binary is shared by every thread that asked for it, so it has
+ * all its contents in place from the start (LOAD_F_LAZY is ignored) and
+ * must be treated as read-only; read_vaddr(), which keeps state, is not
+ * safe on it without a lock of the caller's own. */
+typedef std::shared_ptr<Binary> BinaryHandle;
+
+BinaryHandle get_shared_binary(std::string &fname, Binary::BinaryType type,
+                               int flags = Binary::LOAD_F_DEFAULT);
+void set_shared_binary_budget(size_t bytes);
+void flush_shared_binaries();  /* drops every entry not being loaded */
+
 #endif /* LOADER_H */
@@ -0,0 +1,395 @@
+#ifndef PE_PARSER_H
+#define PE_PARSER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include "loader.hpp"
+
+/* Native PE/PE32+ backend, used by load_binary() for PE images instead of
+ * BFD. Like the ELF parser it reads straight out of a mapping of the file
+ * and only records section offsets and sizes; the caller fills in the
+ * bytes. Function symbols come from the COFF symbol table (when the image
+ * still has one) and from the export directory.
+ */
+
+#define PE_MACHINE_I386          0x014c
+#define PE_MACHINE_AMD64         0x8664
+#define PE_OPT_MAGIC_PE32        0x010b
+#define PE_OPT_MAGIC_PE32PLUS    0x020b
+#define PE_SCN_CNT_CODE          0x00000020
+#define PE_SCN_CNT_INIT_DATA     0x00000040
+#define PE_SCN_CNT_UNINIT_DATA   0x00000080
+#define PE_SCN_MEM_EXECUTE       0x20000000
+#define PE_SYM_DTYPE_FUNCTION    2
+#define PE_DIR_EXPORT            0
+
+#define PE_COFF_HDR_SIZE         20
+#define PE_SCN_HDR_SIZE          40
+#define PE_SYM_SIZE              18
+
+class PeParser {
+public:
+  PeParser(const uint8_t *base, size_t size)
+    : base(base), size(size), scnoff(0), nscns(0), symoff(0), nsyms(0),
+      image_base(0), export_rva(0), export_size(0) {}
+
+  int load(Binary *bin);
+
+private:
+  bool in_bounds(uint64_t off, uint64_t len) const
+    { return (off <= size) && (len <= size - off); }
+
+  /* PE is always little-endian; callers bounds-check before reading */
+  uint16_t le16(uint64_t off) const
+    { return (uint16_t)base[off] | ((uint16_t)base[off+1] << 8); }
+  uint32_t le32(uint64_t off) const
+    { return (uint32_t)le16(off) | ((uint32_t)le16(off+2) << 16); }
+  uint64_t le64(uint64_t off) const
+    { return (uint64_t)le32(off) | ((uint64_t)le32(off+4) << 32); }
+
+  bool rva_to_offset(uint32_t rva, uint64_t len, uint64_t *off) const;
+  const char *str(uint64_t off) const;
+  StrRef coff_name(Binary *bin, uint64_t off) const;
+
+  int load_header(Binary *bin);
+  int load_sections(Binary *bin);
+  int load_coff_symbols(Binary *bin);
+  int load_exports(Binary *bin);
+
+  const uint8_t *base;
+  size_t         size;
+  uint64_t       scnoff;
+  unsigned       nscns;
+  uint64_t       symoff;
+  uint32_t       nsyms;
+  uint64_t       image_base;
+  uint32_t       export_rva;
+  uint32_t       export_size;
+};
+
+/* Translates an RVA to a file offset through the section table, making sure
+ * len bytes from there are backed by the file */
+inline bool
+PeParser::rva_to_offset(uint32_t rva, uint64_t len, uint64_t *off) const
+{
+  unsigned i;
+  uint64_t h;
+  uint32_t va, vsize, rawsize, rawptr;
+
+  for(i = 0; i < nscns; i++) {
+    h = scnoff + (uint64_t)i*PE_SCN_HDR_SIZE;
+    vsize   = le32(h + 8);
+    va      = le32(h + 12);
+    rawsize = le32(h + 16);
+    rawptr  = le32(h + 20);
+    if(rva < va || rva - va >= (vsize > rawsize ? vsize : rawsize)) {
+      continue;
+    }
+    if((uint64_t)(rva - va) + len > rawsize) {
+      return false;
+    }
+    *off = (uint64_t)rawptr + (rva - va);
+    return in_bounds(*off, len);
+  }
+
+  return false;
+}
+
+/* Returns the NUL-terminated string at off, or NULL if it runs off the end
+ * of the file */
+inline const char*
+PeParser::str(uint64_t off) const
+{
+  if(off >= size || !memchr(base + off, '\0', size - off)) {
+    return NULL;
+  }
+
+  return (const char*)(base + off);
+}
+
+/* Decodes an 8-byte COFF name field, which is either inline (and only
+ * NUL-terminated when shorter than 8 bytes) or a reference into the COFF
+ * string table following the symbol table: "/<decimal>" for section names,
+ * four zero bytes and a 32-bit offset for symbol names. */
+inline StrRef
+PeParser::coff_name(Binary *bin, uint64_t off) const
+{
+  int i;
+  uint64_t stroff;
+  const char *s;
+
+  stroff = 0;
+  if(base[off] == '/') {
+    for(i = 1; i < 8 && base[off + i] >= '0' && base[off + i] <= '9'; i++) {
+      stroff = 10*stroff + (base[off + i] - '0');
+    }
+  } else if(le32(off) == 0) {
+    stroff = le32(off + 4);
+  } else {
+    s = (const char*)base + off;
+    return bin->strings.intern(s, strnlen(s, 8));
+  }
+
+  s = NULL;
+  if(symoff) {
+    s = str(symoff + (uint64_t)nsyms*PE_SYM_SIZE + stroff);
+  }
+
+  return bin->strings.intern(s ? s : "");
+}
+
+inline int
+PeParser::load_header(Binary *bin)
+{
+  uint16_t machine, magic, optsize;
+  uint64_t pehdr, opthdr, ddir;
+  uint32_t ndirs;
+
+  if(!in_bounds(0, 0x40) || base[0] != 'M' || base[1] != 'Z') {
+    load_error("not a PE file\n");
+    return -1;
+  }
+
+  pehdr = le32(0x3c);
+  if(!in_bounds(pehdr, 4 + PE_COFF_HDR_SIZE) || memcmp(base + pehdr, "PE\0\0", 4)) {
+    load_error("missing PE signature\n");
+    return -1;
+  }
+
+  machine = le16(pehdr + 4);
+  nscns   = le16(pehdr + 6);
+  symoff  = le32(pehdr + 12);
+  nsyms   = le32(pehdr + 16);
+  optsize = le16(pehdr + 20);
+  opthdr  = pehdr + 4 + PE_COFF_HDR_SIZE;
+  scnoff  = opthdr + optsize;
+
+  if(!in_bounds(opthdr, optsize) || optsize < 2) {
+    load_error("truncated PE optional header\n");
+    return -1;
+  }
+  if(!in_bounds(scnoff, (uint64_t)nscns*PE_SCN_HDR_SIZE)) {
+    load_error("section table extends past the end of the file\n");
+    return -1;
+  }
+  if(symoff && !in_bounds(symoff, (uint64_t)nsyms*PE_SYM_SIZE)) {
+    symoff = 0;
+  }
+
+  magic = le16(opthdr);
+  if(magic == PE_OPT_MAGIC_PE32 && optsize >= 96) {
+    image_base = le32(opthdr + 28);
+    ndirs      = le32(opthdr + 92);
+    ddir       = opthdr + 96;
+  } else if(magic == PE_OPT_MAGIC_PE32PLUS && optsize >= 112) {
+    image_base = le64(opthdr + 24);
+    ndirs      = le32(opthdr + 108);
+    ddir       = opthdr + 112;
+  } else {
+    load_error("unsupported PE optional header (magic 0x%x)\n", magic);
+    return -1;
+  }
+
+  if(ndirs > PE_DIR_EXPORT && ddir + 8*(PE_DIR_EXPORT + 1) <= opthdr + optsize) {
+    export_rva  = le32(ddir + 8*PE_DIR_EXPORT);
+    export_size = le32(ddir + 8*PE_DIR_EXPORT + 4);
+  }
+
+  bin->type  = Binary::BIN_TYPE_PE;
+  bin->entry = image_base + le32(opthdr + 16);
+
+  switch(machine) {
+  case PE_MACHINE_I386:
+    bin->type_str = "pei-i386";
+    bin->arch_str = "i386";
+    bin->arch = Binary::ARCH_X86;
+    bin->bits = 32;
+    break;
+  case PE_MACHINE_AMD64:
+    bin->type_str = "pei-x86-64";
+    bin->arch_str = "i386:x86-64";
+    bin->arch = Binary::ARCH_X86;
+    bin->bits = 64;
+    break;
+  default:
+    load_error("unsupported architecture (0x%x)\n", machine);
+    return -1;
+  }
+
+  return 0;
+}
+
+inline int
+PeParser::load_sections(Binary *bin)
+{
+  unsigned i;
+  uint64_t h;
+  uint32_t vsize, rawsize, flags;
+  Section *sec;
+  Section::SectionType sectype;
+
+  bin->sections.reserve(bin->sections.size() + nscns);
+  for(i = 0; i < nscns; i++) {
+    h = scnoff + (uint64_t)i*PE_SCN_HDR_SIZE;
+
+    flags = le32(h + 36);
+    if(flags & (PE_SCN_CNT_CODE | PE_SCN_MEM_EXECUTE)) {
+      sectype = Section::SEC_TYPE_CODE;
+    } else if(flags & (PE_SCN_CNT_INIT_DATA | PE_SCN_CNT_UNINIT_DATA)) {
+      sectype = Section::SEC_TYPE_DATA;
+    } else {
+      continue;
+    }
+
+    bin->sections.push_back(Section());
+    sec = &bin->sections.back();
+
+    sec->binary = bin;
+    sec->name   = coff_name(bin, h);
+    if(sec->name.empty()) sec->name = bin->strings.intern("<unnamed>");
+    sec->type   = sectype;
+    sec->vma    = image_base + le32(h + 12);
+    sec->offset = le32(h + 20);
+
+    /* The raw size is padded to the file alignment; like BFD, trust the
+     * virtual size when it is the smaller of the two */
+    vsize   = le32(h + 8);
+    rawsize = le32(h + 16);
+    sec->size = (vsize && vsize < rawsize) ? vsize : rawsize;
+
+    /* Uninitialized data (.bss) has nothing in the file */
+    if(!(flags & (PE_SCN_CNT_CODE | PE_SCN_CNT_INIT_DATA)) && !rawsize) {
+      sec->size      = vsize;
+      sec->offset    = 0;
+      sec->zero_fill = true;
+      continue;
+    }
+    if(!in_bounds(sec->offset, sec->size)) {
+      load_error("section '%s' extends past the end of the file\n",
+                 sec->name.c_str());
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+inline int
+PeParser::load_coff_symbols(Binary *bin)
+{
+  uint32_t i;
+  uint64_t s;
+  int16_t scn;
+  Symbol *sym;
+
+  if(!symoff) {
+    return 0;
+  }
+
+  for(i = 0; i < nsyms; i += 1 + base[s + 17]) {
+    s = symoff + (uint64_t)i*PE_SYM_SIZE;
+
+    scn = (int16_t)le16(s + 12);
+    if(((le16(s + 14) >> 4) & 0x3) != PE_SYM_DTYPE_FUNCTION) {
+      continue;
+    }
+    if(scn <= 0 || (unsigned)scn > nscns) {
+      continue;
+    }
+
+    bin->symbols.push_back(Symbol());
+    sym = &bin->symbols.back();
+    sym->type = Symbol::SYM_TYPE_FUNC;
+    sym->sources = Symbol::SYM_SRC_SYMTAB;
+    sym->name = coff_name(bin, s);
+    sym->addr = image_base + le32(scnoff + (uint64_t)(scn - 1)*PE_SCN_HDR_SIZE + 12)
+                + le32(s + 8);
+  }
+
+  return 0;
+}
+
+inline int
+PeParser::load_exports(Binary *bin)
+{
+  uint32_t i, nfuncs, nnames, rva;
+  uint64_t dir, funcs, names, ords, off;
+  uint16_t ord;
+  const char *name;
+  Symbol *sym;
+
+  if(!export_rva || !rva_to_offset(export_rva, 40, &dir)) {
+    return 0;
+  }
+
+  nfuncs = le32(dir + 20);
+  nnames = le32(dir + 24);
+  if(!rva_to_offset(le32(dir + 28), (uint64_t)nfuncs*4, &funcs)
+     || !rva_to_offset(le32(dir + 32), (uint64_t)nnames*4, &names)
+     || !rva_to_offset(le32(dir + 36), (uint64_t)nnames*2, &ords)) {
+    return -1;
+  }
+
+  bin->symbols.reserve(bin->symbols.size() + nnames);
+  for(i = 0; i < nnames; i++) {
+    ord = le16(ords + (uint64_t)i*2);
+    if(ord >= nfuncs) {
+      continue;
+    }
+
+    /* Forwarders point back into the export directory at a "dll.func"
+     * string rather than at code */
+    rva = le32(funcs + (uint64_t)ord*4);
+    if(rva - export_rva < export_size) {
+      continue;
+    }
+
+    name = NULL;
+    if(rva_to_offset(le32(names + (uint64_t)i*4), 1, &off)) {
+      name = str(off);
+    }
+    if(!name) {
+      continue;
+    }
+
+    bin->symbols.push_back(Symbol());
+    sym = &bin->symbols.back();
+    sym->type = Symbol::SYM_TYPE_FUNC;
+    sym->sources = Symbol::SYM_SRC_DYNSYM;
+    sym->name = bin->strings.intern(name);
+    sym->addr = image_base + rva;
+  }
+
+  return 0;
+}
+
+inline int
+PeParser::load(Binary *bin)
+{
+  if(load_header(bin) < 0) {
+    return -1;
+  }
+
+  /* Symbol handling is best-effort only (they may not even be present) */
+  if(!(bin->load_flags & Binary::LOAD_F_NO_SYMTAB)) {
+    load_coff_symbols(bin);
+  }
+  if(!(bin->load_flags & Binary::LOAD_F_NO_DYNSYM)) {
+    load_exports(bin);
+  }
+
+  if(bin->load_flags & Binary::LOAD_F_NO_SECTIONS) {
+    return 0;
+  }
+  return load_sections(bin);
+}
+
+static inline int
+load_pe_native(const uint8_t *base, size_t size, Binary *bin)
+{
+  return PeParser(base, size).load(bin);
+}
+
+#endif /* PE_PARSER_H */
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include "inc/loader.hpp"
+
+/* Times the native backends (the PE parser, the ELF parser under
+ * LOAD_F_NATIVE) against BFD on the same files, e.g.
+ *
+ *   g++ -O2 -o loader_bench loader_bench.cpp inc/loader.cpp -lbfd -lelfmaster -lz -pthread
+ *   ./loader_bench -n 200 a.exe b.dll c.so
+ *
+ * Each file is loaded n times per backend and the best time is kept. */
+
+static double
+now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/* Best time over n loads of fname with flags, or -1 if it fails to load */
+static double
+time_loads(std::string &fname, int flags, int n, size_t *nsecs, size_t *nsyms)
+{
+  int i;
+  double t, best;
+  Binary bin;
+
+  best = -1;
+  for(i = 0; i < n; i++) {
+    t = now();
+    if(load_binary(fname, &bin, Binary::BIN_TYPE_AUTO, flags) < 0) {
+      return -1;
+    }
+    t = now() - t;
+    if(best < 0 || t < best) best = t;
+
+    *nsecs = bin.sections.size();
+    *nsyms = bin.symbols.size();
+    unload_binary(&bin);
+  }
+
+  return best;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, first;
+  size_t nsecs, nsyms, bfd_nsecs, bfd_nsyms;
+  double native, bfd, native_total, bfd_total;
+  std::string fname;
+
+  n     = 50;
+  first = 1;
+  if(argc > 2 && std::string(argv[1]) == "-n") {
+    n     = atoi(argv[2]);
+    first = 3;
+  }
+  if(argc <= first || n <= 0) {
+    printf("Usage: %s [-n iterations] <binary>...\n", argv[0]);
+    return 1;
+  }
+
+  native_total = bfd_total = 0;
+  for(i = first; i < argc; i++) {
+    fname.assign(argv[i]);
+
+    native = time_loads(fname, Binary::LOAD_F_NATIVE, n, &nsecs, &nsyms);
+    bfd    = time_loads(fname, Binary::LOAD_F_BFD, n, &bfd_nsecs, &bfd_nsyms);
+    if(native < 0 || bfd < 0) {
+      printf("%-40s failed to load (%s)\n", argv[i], native < 0 ? "native" : "bfd");
+      continue;
+    }
+
+    printf("%-40s native %9.1f us  bfd %9.1f us  %6.1fx", argv[i],
+           native*1e6, bfd*1e6, bfd/native);
+    if(nsecs != bfd_nsecs || nsyms != bfd_nsyms) {
+      printf("  (sections %zu/%zu, symbols %zu/%zu)",
+             nsecs, bfd_nsecs, nsyms, bfd_nsyms);
+    }
+    printf("\n");
+
+    native_total += native;
+    bfd_total    += bfd;
+  }
+
+  if(native_total > 0) {
+    printf("total: native %.1f us, bfd %.1f us, %.1fx\n",
+           native_total*1e6, bfd_total*1e6, bfd_total/native_total);
+  }
+
+  return 0;
+}
@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "inc/loader.hpp"
+
+/* Stress test for concurrent loads: loads every file once serially, then
+ * again from many threads, both through load_binaries() and with threads
+ * calling load_binary() directly, and checks that every load came out
+ * the same as the serial one. Sections (with their bytes), segments and
+ * symbols are compared, and for files that fail to load, the error
+ * recorded in Binary::error. The serial pass also moves each Binary and
+ * checks that the moved-to one is the same and the moved-from one empty
+ * but still safe to query. Takes the files as arguments or, if there
+ * are none, one per line on stdin, e.g.
+ *
+ *   g++ -O2 -o loader_stress loader_stress.cpp inc/loader.cpp -lbfd -lelfmaster -lz -pthread
+ *   find /usr/lib -name '*.so*' | ./loader_stress -t 16 -f 4
+ *
+ * -f takes the load flags as a number, -r repeats the parallel rounds.
+ * Exits with 1 if any result differs. */
+
+static uint64_t
+hash_bytes(uint64_t h, const uint8_t *p, uint64_t n)
+{
+  uint64_t i;
+
+  for(i = 0; i < n; i++) {
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  }
+
+  return h;
+}
+
+static uint64_t
+hash_string(uint64_t h, const char *s)
+{
+  return hash_bytes(h, (const uint8_t*)s, strlen(s) + 1);
+}
+
+static uint64_t
+hash_u64(uint64_t h, uint64_t v)
+{
+  return hash_bytes(h, (const uint8_t*)&v, sizeof(v));
+}
+
+/* Everything a load produced, folded into one hash */
+static uint64_t
+digest(Binary *bin)
+{
+  uint64_t h;
+  uint8_t *bytes;
+
+  h = 0xcbf29ce484222325ULL;
+  h = hash_string(h, bin->type_str.c_str());
+  h = hash_string(h, bin->arch_str.c_str());
+  h = hash_u64(h, bin->bits);
+  h = hash_u64(h, bin->entry);
+
+  h = hash_u64(h, bin->sections.size());
+  for(auto &sec : bin->sections) {
+    h = hash_string(h, sec.name.c_str());
+    h = hash_u64(h, sec.type);
+    h = hash_u64(h, sec.vma);
+    h = hash_u64(h, sec.size);
+    bytes = sec.get_bytes();
+    h = hash_u64(h, bytes != NULL);
+    if(bytes) h = hash_bytes(h, bytes, sec.size);
+  }
+
+  h = hash_u64(h, bin->segments.size());
+  for(auto &seg : bin->segments) {
+    h = hash_u64(h, seg.vma);
+    h = hash_u64(h, seg.size);
+    h = hash_u64(h, seg.perms);
+    bytes = seg.get_bytes();
+    h = hash_u64(h, bytes != NULL);
+    if(bytes) h = hash_bytes(h, bytes, seg.file_size);
+  }
+
+  h = hash_u64(h, bin->symbols.size());
+  for(auto &sym : bin->symbols) {
+    h = hash_string(h, sym.name.c_str());
+    h = hash_u64(h, sym.type);
+    h = hash_u64(h, sym.addr);
+    h = hash_u64(h, sym.size);
+  }
+
+  return h;
+}
+
+/* One file's result: the digest if it loaded, the error if it did not */
+struct Result {
+  bool        ok;
+  uint64_t    hash;
+  std::string error;
+};
+
+static Result
+load_one(std::string &fname, int flags)
+{
+  Result r;
+  Binary bin;
+
+  r.ok   = (load_binary(fname, &bin, Binary::BIN_TYPE_AUTO, flags) == 0);
+  r.hash = r.ok ? digest(&bin) : 0;
+  if(!r.ok) r.error = bin.error;
+  unload_binary(&bin);
+
+  return r;
+}
+
+/* Loads fname, moves the result into another Binary and checks both */
+static bool
+check_move(std::string &fname, int flags)
+{
+  uint64_t h, addr;
+  StrRef name;
+  Binary bin;
+
+  if(load_binary(fname, &bin, Binary::BIN_TYPE_AUTO, flags) < 0) {
+    return true;
+  }
+  h    = digest(&bin);
+  addr = bin.sections.empty() ? 0 : bin.sections[0].vma;
+  name = bin.symbols.empty() ? StrRef("main") : bin.symbols[0].name;
+
+  Binary moved(std::move(bin));
+  if(digest(&moved) != h) {
+    return false;
+  }
+
+  /* Lookups must hit nothing in the moved-from Binary, not crash */
+  return bin.sections.empty() && bin.segments.empty() && bin.symbols.empty()
+         && !bin.get_section_by_addr(addr) && !bin.get_text_section()
+         && !bin.read_vaddr(addr, 1) && !bin.get_symbol_by_addr(addr)
+         && !bin.get_symbol_by_name(name);
+}
+
+static void
+load_worker(std::vector<std::string> &fnames, int flags,
+            std::atomic<size_t> &next, std::vector<Result> &results)
+{
+  size_t i;
+
+  while((i = next++) < fnames.size()) {
+    results[i] = load_one(fnames[i], flags);
+  }
+}
+
+/* Collects load_binaries() results; its callbacks never run concurrently */
+struct BatchResults {
+  std::vector<std::string> *fnames;
+  std::vector<Result>      *results;
+  std::vector<size_t>       seen;
+
+  void operator()(const std::string &fname, Binary *bin, const std::string &error);
+};
+
+void
+BatchResults::operator()(const std::string &fname, Binary *bin,
+                         const std::string &error)
+{
+  size_t i;
+
+  /* fname is the caller's own entry in fnames, which gives its index */
+  i = &fname - fnames->data();
+  if(i >= fnames->size()) {
+    return;
+  }
+  seen[i]++;
+  (*results)[i].ok   = (bin != NULL);
+  (*results)[i].hash = bin ? digest(bin) : 0;
+  (*results)[i].error = error;
+}
+
+static size_t
+compare(const char *what, std::vector<std::string> &fnames,
+        std::vector<Result> &serial, std::vector<Result> &results)
+{
+  size_t i, bad;
+
+  bad = 0;
+  for(i = 0; i < fnames.size(); i++) {
+    if(serial[i].ok != results[i].ok || serial[i].hash != results[i].hash
+       || serial[i].error != results[i].error) {
+      printf("%s: '%s' differs from the serial load\n", what, fnames[i].c_str());
+      bad++;
+    }
+  }
+
+  return bad;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, flags, rounds;
+  unsigned nthreads;
+  size_t j, loaded, bad;
+  char line[4096];
+  std::vector<std::string> fnames;
+  std::vector<std::thread> workers;
+
+  nthreads = 16;
+  flags    = Binary::LOAD_F_DEFAULT;
+  rounds   = 1;
+  for(i = 1; i < argc; i++) {
+    if(!strcmp(argv[i], "-t") && i + 1 < argc) {
+      nthreads = atoi(argv[++i]);
+    } else if(!strcmp(argv[i], "-f") && i + 1 < argc) {
+      flags = atoi(argv[++i]);
+    } else if(!strcmp(argv[i], "-r") && i + 1 < argc) {
+      rounds = atoi(argv[++i]);
+    } else {
+      fnames.push_back(argv[i]);
+    }
+  }
+  if(fnames.empty()) {
+    while(fgets(line, sizeof(line), stdin)) {
+      line[strcspn(line, "\n")] = '\0';
+      if(line[0]) fnames.push_back(line);
+    }
+  }
+  if(fnames.empty() || !nthreads) {
+    printf("Usage: %s [-t threads] [-f flags] [-r rounds] [binary...]\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<Result> serial(fnames.size());
+  loaded = 0;
+  for(j = 0; j < fnames.size(); j++) {
+    serial[j] = load_one(fnames[j], flags);
+    if(serial[j].ok) loaded++;
+  }
+
+  bad = 0;
+  for(j = 0; j < fnames.size(); j++) {
+    if(!check_move(fnames[j], flags)) {
+      printf("move: '%s' differs after being moved\n", fnames[j].c_str());
+      bad++;
+    }
+  }
+
+  for(i = 0; i < rounds; i++) {
+    /* Threads of our own, calling load_binary() directly */
+    std::vector<Result> results(fnames.size());
+    std::atomic<size_t> next(0);
+    workers.clear();
+    for(j = 0; j < nthreads; j++) {
+      workers.push_back(std::thread(load_worker, std::ref(fnames), flags,
+                                    std::ref(next), std::ref(results)));
+    }
+    for(auto &w : workers) {
+      w.join();
+    }
+    bad += compare("threads", fnames, serial, results);
+
+    /* load_binaries(), whose callbacks get the error for failed files */
+    std::vector<Result> batch(fnames.size());
+    BatchResults collect;
+    collect.fnames  = &fnames;
+    collect.results = &batch;
+    collect.seen.assign(fnames.size(), 0);
+    load_binaries(fnames, Binary::BIN_TYPE_AUTO, flags, nthreads, std::ref(collect));
+    for(j = 0; j < fnames.size(); j++) {
+      if(collect.seen[j] != 1) {
+        printf("load_binaries: '%s' reported %zu times\n",
+               fnames[j].c_str(), collect.seen[j]);
+        bad++;
+      }
+    }
+    bad += compare("load_binaries", fnames, serial, batch);
+  }
+
+  printf("files=%zu loaded=%zu threads=%u rounds=%d mismatches=%zu\n",
+         fnames.size(), loaded, nthreads, rounds, bad);
+
+  return bad ? 1 : 0;
+}
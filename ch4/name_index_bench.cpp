@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "inc/loader.hpp"
+
+/* Microbenchmark for symbol lookups by name: Binary::get_symbol_by_name()
+ * against a linear scan of Binary::symbols, on synthetic tables of
+ * mangled-looking names (100k and 1M symbols by default), e.g.
+ *
+ *   g++ -O2 -o name_index_bench name_index_bench.cpp inc/loader.cpp -lbfd -lelfmaster -lz -pthread
+ *   ./name_index_bench 100000 1000000
+ */
+
+static double
+now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/* Fills bin with n function symbols and builds its name index */
+static void
+make_symbols(Binary *bin, size_t n)
+{
+  size_t i;
+  char name[128];
+
+  bin->symbols.resize(n);
+  for(i = 0; i < n; i++) {
+    snprintf(name, sizeof(name), "_ZN4llvm%zu%sC2ERKNS_%zuE",
+             i % 97, (i & 1) ? "MachineFunctionPass" : "DenseMapInfo", i);
+    bin->symbols[i].type = Symbol::SYM_TYPE_FUNC;
+    bin->symbols[i].name = bin->strings.intern(name);
+    bin->symbols[i].addr = 0x1000 + 16*i;
+  }
+  bin->sym_by_name.build(bin->symbols);
+}
+
+static Symbol*
+linear_lookup(Binary *bin, const std::string &name)
+{
+  size_t i;
+
+  for(i = 0; i < bin->symbols.size(); i++) {
+    if(bin->symbols[i].name == name.c_str()) {
+      return &bin->symbols[i];
+    }
+  }
+
+  return NULL;
+}
+
+static void
+bench(size_t n)
+{
+  size_t i, found, nscan, nindex;
+  double t, scan, index;
+  Binary bin;
+  std::vector<std::string> names;
+
+  make_symbols(&bin, n);
+
+  /* Lookups of names spread over the whole table, one in eight missing */
+  for(i = 0; i < 1024; i++) {
+    if(i % 8 == 7) {
+      names.push_back("_ZN4llvm_not_there_" + std::to_string(i));
+    } else {
+      names.push_back(bin.symbols[(i*2654435761u) % n].name.c_str());
+    }
+  }
+
+  /* The scan is slow enough that fewer rounds do */
+  nscan  = n >= 1000000 ? 64 : 512;
+  nindex = 1000000;
+
+  found = 0;
+  t = now();
+  for(i = 0; i < nscan; i++) {
+    found += (linear_lookup(&bin, names[i % names.size()]) != NULL);
+  }
+  scan = (now() - t)/nscan;
+
+  t = now();
+  for(i = 0; i < nindex; i++) {
+    found += (bin.get_symbol_by_name(names[i % names.size()]) != NULL);
+  }
+  index = (now() - t)/nindex;
+
+  printf("%8zu symbols: linear scan %10.1f ns, index %6.1f ns per lookup (%.0fx) [%zu]\n",
+         n, scan*1e9, index*1e9, scan/index, found);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i;
+
+  if(argc < 2) {
+    bench(100000);
+    bench(1000000);
+    return 0;
+  }
+
+  for(i = 1; i < argc; i++) {
+    bench(strtoul(argv[i], NULL, 0));
+  }
+
+  return 0;
+}